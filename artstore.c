@@ -0,0 +1,123 @@
+/** \file artstore.c
+ * Article access by newsgroup and number or by Message-ID.
+ *
+ * Articles are stored one file per article, hard-linked into each
+ * newsgroup directory and into message.id/NNN/. Group directories are
+ * reached through the descriptors cached by groupfd.c, so callers need
+ * not chdir into the group.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+#include "ln_log.h"
+#include "groupfd.h"
+#include "msgid.h"
+#include "artstore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* a descriptor of a group directory that has been removed, perhaps
+ * to be recreated, refers to a directory without links */
+static int
+stale(int dfd)
+{
+    struct stat st;
+    int e = errno;
+
+    if (fstat(dfd, &st) || st.st_nlink > 0) {
+	errno = e;
+	return 0;
+    }
+    return 1;
+}
+
+/* open a file relative to the cached directory of group; a stale
+ * descriptor is reopened once */
+static int
+group_openat(const char *group, const char *name, int flags)
+{
+    int dfd, fd, retry;
+
+    for (retry = 0; retry < 2; retry++) {
+	if ((dfd = groupfd_dir(group, FALSE)) < 0)
+	    return -1;
+	fd = openat(dfd, name, flags);
+	if (fd >= 0 || errno != ENOENT || !stale(dfd))
+	    return fd;
+	groupfd_forget(group);
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/** Open article \a artno of \a group for reading.
+ * \return stream, or NULL with errno set; ENOENT if there is no such
+ * article. */
+/*@null@*/ FILE *
+artstore_open(const char *group, unsigned long artno)
+{
+    char s[32];
+    int fd;
+    FILE *f;
+
+    snprintf(s, sizeof(s), "%lu", artno);
+    if ((fd = group_openat(group, s, O_RDONLY | O_CLOEXEC)) < 0)
+	return NULL;
+    if (!(f = fdopen(fd, "r")))
+	(void)close(fd);
+    return f;
+}
+
+/** Open the article with Message-ID \a msgid for reading.
+ * \return stream, or NULL with errno set; ENOENT if there is no such
+ * article. */
+/*@null@*/ FILE *
+artstore_open_mid(const char *msgid)
+{
+    const char *m = lookup(msgid);
+
+    if (!m) {
+	errno = ENOENT;
+	return NULL;
+    }
+    return fopen(m, "r");
+}
+
+/** Remove article \a artno from \a group. The article stays available
+ * under its Message-ID and in its other groups.
+ * \return 0 for success, -1 with errno set otherwise. */
+int
+artstore_remove(const char *group, unsigned long artno)
+{
+    char s[32];
+    int dfd, retry;
+
+    snprintf(s, sizeof(s), "%lu", artno);
+    /* a stale descriptor is reopened once, as in group_openat */
+    for (retry = 0; retry < 2; retry++) {
+	if ((dfd = groupfd_dir(group, FALSE)) < 0)
+	    return -1;
+	if (unlinkat(dfd, s, 0) == 0)
+	    return 0;
+	if (errno != ENOENT || !stale(dfd))
+	    return -1;
+	groupfd_forget(group);
+    }
+    errno = ENOENT;
+    return -1;
+}
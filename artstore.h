@@ -0,0 +1,10 @@
+#ifndef ARTSTORE_H
+#define ARTSTORE_H
+
+#include <stdio.h>
+
+/*@null@*/ FILE *artstore_open(const char *group, unsigned long artno);
+/*@null@*/ FILE *artstore_open_mid(const char *msgid);
+int artstore_remove(const char *group, unsigned long artno);
+
+#endif
@@ -11,6 +11,10 @@
 #include "ln_log.h"
 #include "mastring.h"
 #include "msgid.h"
+#include "queueindex.h"
+#include "artstore.h"
+#include "groupfd.h"
+#include "history.h"
 #include "get.h"
 #include "system.h"
 
@@ -261,7 +265,11 @@ static unsigned int delete_mid_from_dir(const char *dir, const char *msgid,
     char **dl, **t;
     unsigned int count = 0;
 
-    dl = spooldirlist_prefix(dir, DIRLIST_ALL, 0);
+    /* the index gives us the candidates, fall back to scanning the
+     * whole queue if it is not available */
+    dl = queueindex_find(dir, msgid);
+    if (!dl)
+	dl = spooldirlist_prefix(dir, DIRLIST_ALL, 0);
     if (!dl) {
 	ln_log(LNLOG_SERR, LNLOG_CARTICLE,
 	       "Cannot read directory \"%s\": %m", dir);
@@ -271,6 +279,7 @@ static unsigned int delete_mid_from_dir(const char *dir, const char *msgid,
 	    if (x) {
 		if (!strcmp(x, msgid)) {
 		    if (0 == log_unlink(*t, 0)) {
+			queueindex_remove(dir, *t);
 			count++;
 			ln_log(LNLOG_SINFO, LNLOG_CARTICLE,
 			       "%s %s", past_action, *t);
@@ -285,11 +294,13 @@ static unsigned int delete_mid_from_dir(const char *dir, const char *msgid,
     return count;
 }
 
-/** marks the article with number \a artno as deleted for the current
- * group, so that the overview reader code can skip it
+/** marks the article with number \a artno as deleted in \a group,
+ * so that the overview reader code can skip it
  * \returns 0 for success, negative for error */
-static int mark_deleted(unsigned long artno) {
-    int fd = open(".overview.deleted", O_WRONLY|O_APPEND|O_CREAT, 0664);
+static int mark_deleted(const char *group, unsigned long artno) {
+    int dfd = groupfd_dir(group, FALSE);
+    int fd = dfd < 0 ? -1 : openat(dfd, ".overview.deleted",
+	    O_WRONLY|O_APPEND|O_CREAT, 0664);
     char buf[64];
 
     if (fd == -1) {
@@ -312,25 +323,40 @@ static int mark_deleted(unsigned long artno) {
     return 0;
 }
 
+/** rewrite a group's .overview in delete_article_flush once its
+ * .overview.deleted has grown to this many bytes, about 8000 articles;
+ * readers skip the listed articles until then, and texpire compacts
+ * the rest */
+#define XOVER_DELETED_COMPACT 65536
+
+/** groups that delete_article_flush checks for compaction */
+static /*@null@*/ /*@only@*/ struct stringlisthead *xover_dirty;
+
+/* unlike findinlist, match the whole group name, alt.test must not
+ * be taken for alt.test.moderated */
+static int
+xover_isdirty(const char *group)
+{
+    struct stringlistnode *n;
+
+    for (n = xover_dirty->head; n->next; n = n->next)
+	if (!strcmp(n->string, group))
+	    return 1;
+    return 0;
+}
+
 void delete_article(const char *mid, const char *action,
 	const char *past_action, const int updatexover)
 {
     const char *filename;
     char *r, *hdr;
     char **ngs, **artnos;
-    int n, num_groups;
+    int n, num_groups, rc;
+    unsigned long u;
     struct stat st;
-    int fd = open(".", O_RDONLY);
     char *msgidalloc = critstrdup(mid, "supersede_cancel");
     char *msgid = msgidalloc;
 
-    if (fd < 0) {
-	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot determine current "
-	       "working directory in supersede_cancel: %m");
-	free(msgidalloc);
-	return;
-    }
-
     SKIPLWS(msgid);
     if (*msgid != '<')
 	goto out;
@@ -364,27 +390,36 @@ void delete_article(const char *mid, const char *action,
 	    ln_log(LNLOG_SDEBUG, LNLOG_CARTICLE,
 		   "debug %s: xref: \"%s\"", action, ngs[n]);
 
-	if (!chdirgroup(ngs[n], FALSE))
+	if (groupfd_dir(ngs[n], FALSE) < 0)
 	    continue;		/* no group dir present */
 
-	if (unlink(artnos[n])) {
+	if (!get_ulong(artnos[n], &u)) {
+	    errno = EINVAL;
+	    rc = -1;
+	} else {
+	    rc = artstore_remove(ngs[n], u);
+	}
+	if (rc) {
 	    ln_log(errno == ENOENT ? LNLOG_SDEBUG : LNLOG_SERR,
 		    LNLOG_CARTICLE,
 		    "%s: failed to unlink %s:%s: %m", action, ngs[n], artnos[n]);
 	} else {
 	    struct newsgroup *g = findgroup(ngs[n], active, -1);
-	    unsigned long u;
 
-	    get_ulong(artnos[n], &u);
 	    if (g && g->first == u)
 		g->first++;
 
 	    ln_log(LNLOG_SINFO, LNLOG_CARTICLE,
 		    "%s %s:%s", past_action, ngs[n], artnos[n]);
-	    if (updatexover)
-		xgetxover(1,NULL,1);
-	    else
-		mark_deleted(u);
+	    mark_deleted(ngs[n], u);
+	    if (updatexover) {
+		/* compact .overview at most once per group in
+		 * delete_article_flush, not once per article */
+		if (!xover_dirty)
+		    initlist(&xover_dirty);
+		if (!xover_isdirty(ngs[n]))
+		    appendtolist(xover_dirty, ngs[n]);
+	    }
 	}
     }
     free(ngs);
@@ -407,13 +442,45 @@ void delete_article(const char *mid, const char *action,
 		       "Failed to unlink %s: %m", filename);
 	} else {
 	    ln_log(LNLOG_SINFO, LNLOG_CARTICLE, "%s %s", past_action, filename);
+	    history_note(msgid, HIST_EXPIRED);
 	}
     }
 
-    if (fchdir(fd))
-	ln_log(LNLOG_SERR, LNLOG_CTOP,
-	       "cannot restore working directory " "in supersede_cancel: %m");
 out:
-    (void)log_close(fd);
     free(msgidalloc);
 }
+
+void delete_article_flush(void)
+{
+    struct stringlistnode *n;
+    struct stat st;
+    int fd = -1, dfd;
+
+    if (!xover_dirty)
+	return;
+
+    for (n = xover_dirty->head; n->next; n = n->next) {
+	/* the rewrite costs O(group size), do it only when
+	 * .overview.deleted has become expensive for the readers */
+	dfd = groupfd_dir(n->string, FALSE);
+	if (dfd < 0 || fstatat(dfd, ".overview.deleted", &st, 0)
+		|| st.st_size < XOVER_DELETED_COMPACT)
+	    continue;
+	if (fd < 0 && (fd = open(".", O_RDONLY)) < 0) {
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot determine current "
+		   "working directory in delete_article_flush: %m");
+	    break;
+	}
+	if (chdirgroup(n->string, FALSE))
+	    (void)xgetxover(1, NULL, 1);
+    }
+    if (fd >= 0) {
+	freexover();
+	if (fchdir(fd))
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot restore working "
+		   "directory in delete_article_flush: %m");
+	(void)close(fd);
+    }
+    freelist(xover_dirty);
+    xover_dirty = NULL;
+}
@@ -0,0 +1,150 @@
+/** \file b_wildmat.c
+ *  Compare wildpat_match() with wildmat() and time both.
+ *
+ *  First matches many random patterns against random texts with both
+ *  and fails if they ever disagree, then times typical XPAT and group
+ *  patterns. An optional argument gives the number of rounds.
+ *
+ *  See AUTHORS for copyright holders and contributors.
+ *  See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static unsigned long seed = 1;
+
+static unsigned int
+rnd(unsigned int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (unsigned int)((seed >> 16) % n);
+}
+
+static void
+randstr(char *s, const char *alphabet, unsigned int max)
+{
+    unsigned int n = rnd(max + 1), k = (unsigned int)strlen(alphabet);
+
+    while (n--)
+	*s++ = alphabet[rnd(k)];
+    *s = '\0';
+}
+
+/* wildmat() reads past the end of malformed classes, avoid those */
+static int
+wellformed(const char *p)
+{
+    for (; *p; p++) {
+	if (*p == '\\' && p[1])
+	    p++;
+	else if (*p == '[') {
+	    p++;
+	    if (*p == '^')
+		p++;
+	    if (*p == ']' || *p == '-')
+		p++;
+	    for (; *p && *p != ']'; p++)
+		if (*p == '-' && p[1] && p[1] != ']')
+		    p++;
+	    if (!*p)
+		return 0;
+	}
+    }
+    return 1;
+}
+
+static int
+check(void)
+{
+    static const char pa[] = "ab*?[]^-\\\344";
+    static const char ta[] = "ab-]^\\\344";
+    char p[16], t[16];
+    int i, j, bad = 0;
+
+    for (i = 0; i < 20000; i++) {
+	struct wildpat *w;
+
+	do
+	    randstr(p, pa, 8);
+	while (!wellformed(p));
+	w = wildpat_compile(p);
+	for (j = 0; j < 50; j++) {
+	    randstr(t, ta, 10);
+	    if (!wildmat(t, p) != !wildpat_match(w, t, strlen(t))) {
+		fprintf(stderr, "mismatch: pattern \"%s\" text \"%s\"\n",
+			p, t);
+		bad++;
+	    }
+	}
+	wildpat_free(w);
+    }
+    return bad;
+}
+
+static void
+bench(const char *what, const char *p, const char *const *t, int n,
+	long rounds)
+{
+    struct wildpat *w = wildpat_compile(p);
+    clock_t c0, c1, c2;
+    long r, m1 = 0, m2 = 0;
+    size_t *len = (size_t *)malloc(n * sizeof(size_t));
+    int i;
+
+    for (i = 0; i < n; i++)
+	len[i] = strlen(t[i]);
+    c0 = clock();
+    for (r = 0; r < rounds; r++)
+	for (i = 0; i < n; i++)
+	    m1 += wildmat(t[i], p);
+    c1 = clock();
+    for (r = 0; r < rounds; r++)
+	for (i = 0; i < n; i++)
+	    m2 += wildpat_match(w, t[i], len[i]);
+    c2 = clock();
+    printf("%-10s wildmat %6.3f s  compiled %6.3f s  %s\n", what,
+	    (double)(c1 - c0) / CLOCKS_PER_SEC,
+	    (double)(c2 - c1) / CLOCKS_PER_SEC,
+	    m1 == m2 ? "" : "RESULTS DIFFER");
+    wildpat_free(w);
+    free(len);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *const refs[] = {
+	"<a1b2c3@news.example.org> <d4e5f6@host.example.com> "
+	    "<g7h8i9@news.example.org> <j0k1l2@mail.example.net>",
+	"<x9y8z7@example.invalid>",
+	"<m3n4@news.example.org> <o5p6@news.example.org> "
+	    "<q7r8@news.example.org> <s9t0@news.example.org> "
+	    "<u1v2@news.example.org> <w3x4@news.example.org>",
+	"<AAAAaaaa.1234@long-host-name.example.com> "
+	    "<BBBBbbbb.5678@long-host-name.example.com>",
+    };
+    static const char *const groups[] = {
+	"comp.os.linux.misc", "comp.os.linux.networking", "de.comp.os.unix",
+	"alt.test", "news.software.nntp", "comp.lang.c", "de.alt.test",
+	"comp.os.linux.announce", "sci.math", "rec.arts.sf.written",
+    };
+    long rounds = argc > 1 ? atol(argv[1]) : 20000;
+    int bad;
+
+    if ((bad = check())) {
+	fprintf(stderr, "%d mismatches\n", bad);
+	exit(EXIT_FAILURE);
+    }
+    bench("xpat-hit", "*<o5p6@news.example.org>*", refs, 4, rounds);
+    bench("xpat-miss", "*<nothere@news.example.org>*", refs, 4, rounds);
+    bench("multistar", "*a*b*c*d*e*f*", refs, 4, rounds);
+    bench("class", "*[0-9][0-9][0-9][0-9]@*", refs, 4, rounds);
+    bench("group", "comp.os.linux.*", groups, 10, rounds);
+    bench("group2", "*.test", groups, 10, rounds);
+    exit(EXIT_SUCCESS);
+}
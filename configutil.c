@@ -12,6 +12,7 @@
 #include "configparam.h"
 #include "get.h"
 #include "groupselect.h"
+#include "msgid.h"
 
 #include <ctype.h>
 #include <errno.h>
@@ -55,6 +56,12 @@ int ln_log_posterip = 0;
 int filtermode = FM_XOVER | FM_HEAD;
 			/* filter xover headers or heads or both(default) */
 long windowsize = 5;
+long receive_queue = 0;		/* bytes fetchnews buffers in its receive
+				   process, 0 to read the socket directly */
+unsigned long msgid_buckets = 1000;	/* message.id directories that
+					   texpire -H rehashes into */
+unsigned long xpat_index = 1000;	/* smallest group that gets a
+					   trigram index for XPAT */
 
 /*@null@*/ char *filterfile = NULL;
 /*@null@*/ char *pseudofile = NULL;	/* filename containing pseudoarticle body */
@@ -364,6 +371,15 @@ readconfig(/*@null@*/ const char *configfile)
 				   " (but limited by TCP send "
 				   "buffer size)", windowsize);
 		    break;
+		case CP_RCVQUEUE:
+		    receive_queue = strtol(value, NULL, 10);
+		    if (receive_queue < 0)
+			receive_queue = 0;
+		    if (debugmode & DEBUG_CONFIG)
+			ln_log_sys(LNLOG_SDEBUG, LNLOG_CTOP,
+				   "config: receive_queue is %ld bytes",
+				   receive_queue);
+		    break;
 		case CP_GROUPEXP:
 		    {
 			char *m = value;
@@ -425,6 +441,30 @@ readconfig(/*@null@*/ const char *configfile)
 		    ln_log(LNLOG_SERR, LNLOG_CTOP,
 			   "%s is obsolete: use filterfile instead", param);
 		    break;
+		case CP_XPATINDEX:
+		    xpat_index = strtoul(value, NULL, 10);
+		    if (debugmode & DEBUG_CONFIG)
+			ln_log_sys(LNLOG_SDEBUG, LNLOG_CTOP,
+				   "config: xpat_index is %lu articles",
+				   xpat_index);
+		    break;
+		case CP_OVHEADERS:
+		    xoverextra_set(value);
+		    if (debugmode & DEBUG_CONFIG)
+			ln_log_sys(LNLOG_SDEBUG, LNLOG_CTOP,
+				   "config: overview_headers is %s", value);
+		    break;
+		case CP_MSGIDBUCKETS:
+		    msgid_buckets = strtoul(value, NULL, 10);
+		    if (msgid_buckets < 1)
+			msgid_buckets = 1;
+		    if (msgid_buckets > MSGID_MAXBUCKETS)
+			msgid_buckets = MSGID_MAXBUCKETS;
+		    if (debugmode & DEBUG_CONFIG)
+			ln_log_sys(LNLOG_SDEBUG, LNLOG_CTOP,
+				   "config: msgid_buckets is %lu",
+				   msgid_buckets);
+		    break;
 		case CP_MAXFETCH:
 		    artlimit = strtoul(value, NULL, 10);
 		    if (debugmode & DEBUG_CONFIG)
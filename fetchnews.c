@@ -15,6 +15,9 @@
 #include "msgid.h"
 #include "groupselect.h"
 #include "fetchnews.h"
+#include "groupfd.h"
+#include "queueindex.h"
+#include "history.h"
 
 #include <sys/types.h>
 #include <ctype.h>
@@ -902,6 +905,9 @@ create_pseudo_header(const char *subject, const char *from,
 }
 
 /** for delaybody: store pseudo article header
+ *  The header is fed to store_stream() straight from memory, so there
+ *  is no intermediate file to write, sync and remove for each XOVER
+ *  line; the caller's store batch provides the durability barrier.
  *  \return
  *  - -1 for error
  *  -  0 for sucess
@@ -911,7 +917,19 @@ store_pseudo_header(mastr *s)
 {
     int rc = 0;
     int tmpfd;
-    mastr *tmpfn = mastr_new(LN_PATH_MAX);
+    mastr *tmpfn;
+#ifdef HAVE_FMEMOPEN
+    FILE *i = fmemopen(mastr_modifyable_str(s), mastr_len(s), "r");
+
+    if (i) {
+	rc = store_stream(i, 0, NULL, (ssize_t)-1, 1) ? -1 : 0;
+	(void)fclose(i);
+	return rc;
+    }
+    /* fall back to a temporary file */
+#endif
+
+    tmpfn = mastr_new(LN_PATH_MAX);
 
     (void)mastr_vcat(tmpfn, spooldir, "/temp.files/delaypseudo_XXXXXXXXXX", NULL);
     tmpfd = safe_mkstemp(mastr_modifyable_str(tmpfn));
@@ -942,6 +960,26 @@ out:
     return rc;
 }
 
+/** \return a copy of field \p field (counting from 0) of the XOVER
+ * line \p l, or NULL if the line has fewer fields */
+static /*@null@*/ /*@only@*/ char *
+xover_field(const char *l, int field)
+{
+    size_t len;
+    char *t;
+
+    while (field-- > 0)
+	if (!(l = strchr(l, '\t')))
+	    return NULL;
+	else
+	    l++;
+    len = strcspn(l, "\t");
+    t = (char *)critmalloc(len + 1, "xover_field");
+    memcpy(t, l, len);
+    t[len] = '\0';
+    return t;
+}
+
 /**
  * get headers of articles with XOVER and return a stringlist of article
  * numbers to get (or number of pseudo headers stored)
@@ -958,6 +996,11 @@ fn_doxover(struct stringlisthead *stufftoget,
     unsigned long count = 0, dupes = 0, seen = 0;
     long reply;
     int delaybody_this_group = delaybody_group(groupname);
+    struct stringlisthead *overview = NULL;
+    struct stringlistnode *n;
+    char **mids = NULL, *have = NULL;
+    size_t nlines = 0, i;
+    int complete;
 
     putaline(nntpout, "XOVER %lu-%lu", first, last);
     l = mgetaline(nntpin);
@@ -966,7 +1009,26 @@ fn_doxover(struct stringlisthead *stufftoget,
 	       "Unknown reply to XOVER command: %s", l ? l : "(null)");
 	return -2;
     }
+    initlist(&overview);
     while ((l = mgetaline(nntpin)) && strcmp(l, ".")) {
+	appendtolist(overview, l);
+	nlines++;
+    }
+    /* l points into a static buffer that lookup() and
+     * store_pseudo_header() reuse below */
+    complete = l != NULL;
+
+    if ((filtermode & FM_XOVER) || delaybody_this_group) {
+	/* check all Message-IDs at once rather than in the server's
+	 * order, see history_have_batch() */
+	mids = (char **)critmalloc(nlines * sizeof(*mids) + 1, "fn_doxover");
+	have = (char *)critmalloc(nlines + 1, "fn_doxover");
+	for (i = 0, n = overview->head; n->next; n = n->next, i++)
+	    mids[i] = xover_field(n->string, 4);
+	history_have_batch((const char *const *)mids, nlines, have);
+    }
+
+    for (i = 0, n = overview->head; n->next; n = n->next, i++) {
 	char *xover[20];	/* RATS: ignore */
 	char *artno, *subject, *from, *date, *messageid;
 	char *references, *lines, *bytes, *xref;
@@ -974,11 +1036,11 @@ fn_doxover(struct stringlisthead *stufftoget,
 	int num_groups;
 
 	seen ++;
-	if (abs(str_nsplit(xover, l, "\t", sizeof(xover) / sizeof(xover[0]))) <
-	    8) {
+	if (abs(str_nsplit(xover, n->string, "\t",
+			sizeof(xover) / sizeof(xover[0]))) < 8) {
 	    ln_log(LNLOG_SERR, LNLOG_CGROUP,
 		   "read broken xover line, too few fields: \"%s\", skipping",
-		   l);
+		   n->string);
 	    goto next_over;
 	}
 
@@ -1030,8 +1092,8 @@ fn_doxover(struct stringlisthead *stufftoget,
 		mastr_delete(s);
 		goto next_over;
 	    }
-	    if (ihave(messageid)) {
-		/* we have the article already */
+	    if (have[i]) {
+		/* we have or had the article already */
 		dupes++;
 		mastr_delete(s);
 		goto next_over;
@@ -1055,11 +1117,18 @@ next_over:
 	if (newsgroups_list)
 	  free(newsgroups_list);
     }
+    if (mids) {
+	for (i = 0; i < nlines; i++)
+	    free(mids[i]);
+	free(mids);
+	free(have);
+    }
+    freelist(overview);
 
     {
 	int rc = count;
 
-	if (l && strcmp(l, ".") == 0) {
+	if (complete) {
 	    ln_log(LNLOG_SINFO, LNLOG_CGROUP, "%s: XOVER: %lu seen, %lu I have, "
 		    "%lu filtered, %lu to get",
 		    groupname, seen, dupes, groupkilled, count);
@@ -1089,6 +1158,12 @@ fn_doxhdr(struct stringlisthead *stufftoget, unsigned long first,
     char *l;
     unsigned long count = 0;
     long reply;
+    struct stringlisthead *cand = NULL;
+    struct stringlistnode *n;
+    const char **mids;
+    char *have;
+    size_t ncand = 0, i;
+    int complete;
 
     putaline(nntpout, "XHDR message-id %lu-%lu", first, last);
     l = mgetaline(nntpin);
@@ -1097,19 +1172,37 @@ fn_doxhdr(struct stringlisthead *stufftoget, unsigned long first,
 	       "Unknown reply to XHDR command: %s", l ? l : "(null)");
 	return -2;
     }
+    initlist(&cand);
     while ((l = mgetaline(nntpin)) && strcmp(l, ".")) {
+	appendtolist(cand, l);
+	ncand++;
+    }
+    /* l points into a static buffer that history_have_batch() reuses */
+    complete = l != NULL;
+
+    /* check all Message-IDs at once, see history_have_batch() */
+    mids = (const char **)critmalloc(ncand * sizeof(*mids) + 1, "fn_doxhdr");
+    have = (char *)critmalloc(ncand + 1, "fn_doxhdr");
+    for (i = 0, n = cand->head; n->next; n = n->next, i++) {
 	/* format is: [# of article] [message-id] */
-	char *t;
+	const char *t = n->string;
 
-	t = l;
 	SKIPWORD(t);
-	if (ihave(t))
+	mids[i] = t;
+    }
+    history_have_batch(mids, ncand, have);
+    for (i = 0, n = cand->head; n->next; n = n->next, i++) {
+	if (have[i])
 	    continue;
 	/* mark this article */
 	count++;
-	appendtolist(stufftoget, l);
+	appendtolist(stufftoget, n->string);
     }
-    if (l && strcmp(l, ".") == 0)
+    free(have);
+    free(mids);
+    freelist(cand);
+
+    if (complete)
 	return count;
     else
 	return -1;
@@ -1762,14 +1855,23 @@ processupstream(struct serverlist *cursrv, const char *const server,
 
 	    /* newserver == 0 means we'll be writing back the "from"
 	     * article mark, to retry next run */
-	    if (fault == 0)
+	    if (fault == 0) {
+		/* the articles must be on disk before the new high
+		 * water mark is written below */
+		store_batch_begin();
 		newserver = getgroup(cursrv, g, from);
-	    else
-		newserver = 0;
-	    if (newserver == (unsigned long)-2) { /* "fatal" from getgroup */
-		fault = 1;
+		if (newserver == (unsigned long)-2) { /* "fatal" from getgroup */
+		    fault = 1;
+		    newserver = 0;
+		}
+		if (store_batch_commit()) {
+		    ln_log(LNLOG_SERR, LNLOG_CGROUP,
+			    "%s: cannot commit articles to disk, "
+			    "keeping old water mark", ng);
+		    newserver = 0;
+		}
+	    } else
 		newserver = 0;
-	    }
 	    /* write back as good info as we have, drop if no real info */
 	    if (newserver != 0) {
 		fprintf(f, "%s %lu\n", ng, newserver);
@@ -1862,6 +1964,8 @@ postarticles(const struct serverlist *cursrv)
 				ln_log(LNLOG_SERR, LNLOG_CARTICLE,
 				       "Cannot delete article %s: %m", *y);
 				/* FIXME: don't fail here */
+			    } else {
+				queueindex_remove("out.going", *y);
 			    }
 			} else {
 			    int xdup = 0;
@@ -1882,7 +1986,8 @@ postarticles(const struct serverlist *cursrv)
 				mod = checkstatus(f1, 'm');
 				app = fgetheader(f, "Approved:", 1);
 				if (mod != NULL && app == NULL) {
-				    (void)log_unlink(*y, 1);
+				    if (0 == log_unlink(*y, 1))
+					queueindex_remove("out.going", *y);
 				} else {
 				    /* set u+x bit to mark article as posted */
 				    chmod(*y, 0540);
@@ -2013,12 +2118,12 @@ do_server(struct serverlist *cursrv, int forceactive)
     }
 
     /* fetch by MID */
-    switch (getmsgidlist(msgidlist)) {
-    case 0:
+    store_batch_begin();
+    res = getmsgidlist(msgidlist);
+    if (store_batch_commit())
+	flag |= f_error;
+    else if (res == 0)
 	flag |= f_mayshort;
-    default:
-	;
-    }
 
     /* do regular fetching of articles, headers, delayed bodies */
     if (action_method & (FETCH_ARTICLE|FETCH_HEADER|FETCH_BODY)
@@ -2326,6 +2431,9 @@ main(int argc, char **argv)
     signal(SIGINT, SIG_IGN);
     signal(SIGTERM, SIG_IGN);	/* FIXME */
 
+    /* in case a signal interrupted a batch */
+    (void)store_batch_commit();
+
     if (!postonly) {
 	if (rc == 0 && forceactive) {
 	    /* read local groups into the new active */
@@ -2352,6 +2460,12 @@ main(int argc, char **argv)
 	ln_log(LNLOG_SINFO, LNLOG_CTOP,
 	       "%s: %lu articles and %lu headers fetched, %lu killed, %lu posted, in %ld seconds",
 	       myname, globalfetched, globalhdrfetched, globalkilled, globalposted, (long int)(time(0) - starttime));
+	if (history_stats.lookups)
+	    ln_log(LNLOG_SINFO, LNLOG_CTOP,
+		   "%s: %lu Message-IDs checked, %lu known, %lu filter false "
+		   "positives, %lu stat calls avoided",
+		   myname, history_stats.lookups, history_stats.hits,
+		   history_stats.falsepos, history_stats.avoided);
 
 	if (only_fetch_once)
 	    freegrouplist(done_groups);
@@ -2363,6 +2477,7 @@ main(int argc, char **argv)
 	freeservers(only_server);
     freeoptions();
     freexover();
+    groupfd_closeall();
     freeactive(active);
     active = NULL;
     freeallfilter(filter);
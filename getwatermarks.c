@@ -1,4 +1,6 @@
 #include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <limits.h>
 #include <dirent.h>
 #include <ctype.h>
@@ -12,17 +14,31 @@
  */
 int getwatermarks(unsigned long *f, unsigned long *l,
 		  unsigned long /*@null@*/ *c) {
+    return getwatermarksat(AT_FDCWD, f, l, c);
+}
+
+/** Like getwatermarks(), but for the newsgroup directory \a dirfd
+ * rather than the current directory.
+ */
+int getwatermarksat(int dirfd, unsigned long *f, unsigned long *l,
+		  unsigned long /*@null@*/ *c) {
     char *q;
     unsigned long first = ULONG_MAX;
     unsigned long last = 0, count = 0;
     DIR *ng;
     struct dirent *nga;
+    int fd;
 
     assert(f);
     assert(l);
 
-    ng = opendir(".");
+    fd = openat(dirfd, ".", O_RDONLY);
+    if (fd < 0) {
+	return -1;
+    }
+    ng = fdopendir(fd);
     if (ng == NULL) {
+	(void)close(fd);
 	return -1;
     }
 
@@ -0,0 +1,195 @@
+/** \file groupfd.c
+ * Cache of open newsgroup directories and .overview files.
+ *
+ * store_stream() links every article into each of its newsgroups and
+ * appends to their .overview files. Rather than walking the path and
+ * changing the working directory for each article, we keep a few
+ * directory descriptors and .overview append descriptors open and use
+ * the *at() system calls relative to them.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+#include "critmem.h"
+#include "ln_log.h"
+#include "ln_dir.h"
+#include "mastring.h"
+#include "groupfd.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+/** number of newsgroups we keep open */
+#define GROUPFD_MAX 16
+
+static struct groupfd {
+    char *name;			/* newsgroup, NULL if slot unused */
+    int dirfd;			/* directory of the newsgroup */
+    int ovfd;			/* .overview opened for appending, or -1 */
+    unsigned long used;		/* LRU stamp */
+} cache[GROUPFD_MAX];
+
+static unsigned long lru_clock;
+
+static void
+slot_close(struct groupfd *e)
+{
+    if (e->ovfd >= 0)
+	(void)close(e->ovfd);
+    if (e->dirfd >= 0)
+	(void)close(e->dirfd);
+    free(e->name);
+    e->name = NULL;
+    e->dirfd = e->ovfd = -1;
+}
+
+/* return slot of group, or NULL if not cached */
+static struct groupfd *
+slot_find(const char *group)
+{
+    int i;
+
+    for (i = 0; i < GROUPFD_MAX; i++) {
+	if (cache[i].name && 0 == strcmp(cache[i].name, group)) {
+	    cache[i].used = ++lru_clock;
+	    return &cache[i];
+	}
+    }
+    return NULL;
+}
+
+/* open the directory of group, creating it if requested */
+static int
+open_groupdir(const char *group, int creatdir)
+{
+    mastr *s = mastr_new(LN_PATH_MAX);
+    char *p;
+    size_t len;
+    int fd;
+
+    mastr_vcat(s, spooldir, "/", NULL);
+    len = mastr_len(s);
+    mastr_vcat(s, group, "/", NULL);
+    for (p = mastr_modifyable_str(s) + len; *p; p++) {
+	if (*p == '.')
+	    *p = '/';
+	else
+	    *p = tolower((unsigned char)*p);
+    }
+
+    fd = open(mastr_str(s), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && creatdir) {
+	if (mkdir_parent(mastr_str(s), MKDIR_MODE))
+	    ln_log(LNLOG_SERR, LNLOG_CGROUP, "mkdir %s: %m", mastr_str(s));
+	else
+	    fd = open(mastr_str(s), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd < 0 && (errno != ENOENT || creatdir))
+	ln_log(LNLOG_SERR, LNLOG_CGROUP, "cannot open %s: %m", mastr_str(s));
+    mastr_delete(s);
+    return fd;
+}
+
+/** Get a directory descriptor for \a group, suitable for the *at()
+ * functions. The descriptor belongs to the cache; do not close it.
+ * \return descriptor, or -1 if the directory is missing or cannot be
+ * opened. */
+int
+groupfd_dir(const char *group,
+	int creatdir /** if true, create missing directories */)
+{
+    struct groupfd *e = slot_find(group);
+    int i, fd;
+
+    if (e)
+	return e->dirfd;
+
+    fd = open_groupdir(group, creatdir);
+    if (fd < 0)
+	return -1;
+
+    /* evict the least recently used entry */
+    e = &cache[0];
+    for (i = 1; i < GROUPFD_MAX && e->name; i++) {
+	if (!cache[i].name || cache[i].used < e->used)
+	    e = &cache[i];
+    }
+    if (e->name)
+	slot_close(e);
+    e->name = critstrdup(group, "groupfd_dir");
+    e->dirfd = fd;
+    e->ovfd = -1;
+    e->used = ++lru_clock;
+    return fd;
+}
+
+/** Get a descriptor of the .overview file of \a group, opened for
+ * appending. The descriptor belongs to the cache; do not close it.
+ * \return descriptor, or -1 in case of trouble. */
+int
+groupfd_overview(const char *group)
+{
+    struct groupfd *e;
+    struct stat st;
+
+    if (groupfd_dir(group, FALSE) < 0)
+	return -1;
+    e = slot_find(group);
+
+    /* texpire and xgetxover rewrite .overview and rename the new file
+     * into place; our descriptor then refers to the unlinked old one */
+    if (e->ovfd >= 0 && (fstat(e->ovfd, &st) || st.st_nlink == 0)) {
+	(void)close(e->ovfd);
+	e->ovfd = -1;
+    }
+    if (e->ovfd < 0) {
+	e->ovfd = openat(e->dirfd, ".overview",
+		O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, (mode_t)0660);
+	if (e->ovfd < 0)
+	    ln_log(LNLOG_SERR, LNLOG_CGROUP,
+		    "cannot open .overview of %s: %m", group);
+    }
+    return e->ovfd;
+}
+
+/** Drop \a group from the cache, for instance after its directory has
+ * been removed. */
+void
+groupfd_forget(const char *group)
+{
+    struct groupfd *e = slot_find(group);
+
+    if (e)
+	slot_close(e);
+}
+
+/** Close all cached descriptors. */
+void
+groupfd_closeall(void)
+{
+    int i;
+
+    for (i = 0; i < GROUPFD_MAX; i++) {
+	if (cache[i].name)
+	    slot_close(&cache[i]);
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef GROUPFD_H
+#define GROUPFD_H
+
+int groupfd_dir(const char *group, int creatdir);
+int groupfd_overview(const char *group);
+void groupfd_forget(const char *group);
+void groupfd_closeall(void);
+
+#endif
@@ -0,0 +1,394 @@
+/** \file hdrcache.c
+ * Per-group cache of header values that are not in the overview.
+ *
+ * HDR, XHDR and XPAT on a header that neither the overview nor
+ * overview_headers cover have to read every article of the range.
+ * nntpd remembers the values it read in <group>/.hdrcache.<header>, a
+ * line "artno<TAB>value" per article, or just "artno" if the article
+ * lacks the header, so that later requests for the same header only
+ * read the articles that arrived since. New lines are appended with a
+ * single write(), so concurrent nntpd processes at worst add
+ * duplicates.
+ *
+ * The first line records the inode number of .overview as generation:
+ * texpire and xgetxover() replace .overview when they remove articles,
+ * which discards the cache. It is rebuilt on the next request.
+ *
+ * Clients choose the header names, so a group holds at most
+ * HDRCACHE_MAX caches; further headers are read from the articles.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+#include "critmem.h"
+#include "hdrcache.h"
+#include "ln_log.h"
+#include "mastring.h"
+#include "sgetcwd.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#define HDRCACHE_MAGIC "LNHC1"
+#define HDRCACHE_NAMEMAX 64
+#define HDRCACHE_MAX 8		/* caches per group */
+#define HC_ABSENT ((size_t)-1)	/* article lacks the header */
+
+struct hcent {
+    unsigned long artno;
+    size_t val;			/* offset into hc.vals, or HC_ABSENT */
+};
+
+static struct {
+    int active;			/* between hdrcache_open and _close */
+    int usable;			/* cache file can be appended to */
+    char name[HDRCACHE_NAMEMAX + 16];	/* cache file name */
+    dev_t dirdev;		/* group directory */
+    ino_t dirino;
+    dev_t dev;			/* cache file as loaded */
+    ino_t ino;
+    off_t loaded;		/* bytes of it parsed */
+    struct hcent *ent;
+    unsigned long n, size;
+    int sorted;
+    char *vals;			/* NUL terminated values */
+    size_t vlen, vsize;
+    mastr *pending;		/* lines to append in hdrcache_close() */
+} hc;
+
+static int
+_comphcent(const void *a, const void *b)
+{
+    const struct hcent *la = (const struct hcent *)a;
+    const struct hcent *lb = (const struct hcent *)b;
+
+    return (la->artno > lb->artno) - (la->artno < lb->artno);
+}
+
+static void
+hc_reset(void)
+{
+    hc.n = 0;
+    hc.vlen = 0;
+    hc.sorted = 1;
+    hc.loaded = 0;
+    hc.dev = 0;
+    hc.ino = 0;
+}
+
+/** add an entry, \p val of length \p len or NULL if the header is
+ * absent */
+static void
+hc_add(unsigned long artno, /*@null@*/ const char *val, size_t len)
+{
+    if (hc.n == hc.size) {
+	hc.size = hc.size ? 2 * hc.size : 256;
+	hc.ent = (struct hcent *)critrealloc((char *)hc.ent,
+		hc.size * sizeof(struct hcent), "hdrcache");
+    }
+    if (hc.n && artno < hc.ent[hc.n - 1].artno)
+	hc.sorted = 0;
+    hc.ent[hc.n].artno = artno;
+    if (val) {
+	if (hc.vlen + len + 1 > hc.vsize) {
+	    hc.vsize = 2 * (hc.vlen + len + 1);
+	    hc.vals = (char *)critrealloc(hc.vals, hc.vsize, "hdrcache");
+	}
+	memcpy(hc.vals + hc.vlen, val, len);
+	hc.vals[hc.vlen + len] = '\0';
+	hc.ent[hc.n].val = hc.vlen;
+	hc.vlen += len + 1;
+    } else {
+	hc.ent[hc.n].val = HC_ABSENT;
+    }
+    hc.n++;
+}
+
+/** add the entry of cache file line \p l */
+static void
+hc_parseline(const char *l)
+{
+    unsigned long artno;
+    char *tab;
+
+    if ((artno = strtoul(l, &tab, 10)) != 0) {
+	if (*tab == '\t')
+	    hc_add(artno, tab + 1, strlen(tab + 1));
+	else
+	    hc_add(artno, NULL, 0);
+    }
+}
+
+/** parse the cache file from hc.loaded on.
+ * \return 0 if it is stale or unusable */
+static int
+hc_load(int fd, ino_t generation)
+{
+    char buf[8192];
+    mastr *line = mastr_new(256);
+    ssize_t r;
+    int ok = 1, first = (hc.loaded == 0);
+
+    if (lseek(fd, hc.loaded, SEEK_SET) < 0) {
+	mastr_delete(line);
+	return 0;
+    }
+    while (ok && (r = read(fd, buf, sizeof(buf) - 1)) > 0) {
+	char *p = buf, *q;
+
+	buf[r] = '\0';
+	while (ok && (q = (char *)memchr(p, '\n', (size_t)(buf + r - p)))) {
+	    *q = '\0';
+	    (void)mastr_cat(line, p);
+	    hc.loaded += (off_t)mastr_len(line) + 1;
+	    if (first) {
+		unsigned long g;
+
+		ok = sscanf(mastr_str(line), HDRCACHE_MAGIC " %lu", &g) == 1
+		    && g == (unsigned long)generation;
+		first = 0;
+	    } else {
+		hc_parseline(mastr_str(line));
+	    }
+	    mastr_clear(line);
+	    p = q + 1;
+	}
+	/* keep an incomplete line for the next read */
+	(void)mastr_cat(line, p);
+    }
+    /* a line still being written is read next time */
+    mastr_delete(line);
+    return ok;
+}
+
+/** \return the number of header caches in the current directory;
+ * temporary files have a dot after the prefix, header names do not */
+static unsigned long
+hc_count(void)
+{
+    DIR *d;
+    struct dirent *de;
+    unsigned long n = 0;
+
+    if (!(d = opendir(".")))
+	return 0;
+    while ((de = readdir(d))) {
+	if (!strncmp(de->d_name, ".hdrcache.", 10)
+		&& !strchr(de->d_name + 10, '.'))
+	    n++;
+    }
+    (void)closedir(d);
+    return n;
+}
+
+/** replace the cache file by an empty one for \p generation */
+static int
+hc_create(ino_t generation)
+{
+    char newfile[] = ".hdrcache.tmp.XXXXXX";
+    char head[64];
+    struct stat st;
+    int fd, len;
+
+    hc_reset();
+    if ((fd = mkstemp(newfile)) < 0)
+	return 0;
+    len = snprintf(head, sizeof(head), "%s %lu\n", HDRCACHE_MAGIC,
+	    (unsigned long)generation);
+    (void)fchmod(fd, (mode_t)0660);
+    if (write(fd, head, (size_t)len) != len || fstat(fd, &st)
+	    || rename(newfile, hc.name)) {
+	ln_log(LNLOG_SERR, LNLOG_CGROUP, "cannot write %s/%s: %m",
+		sgetcwd(), hc.name);
+	(void)close(fd);
+	(void)unlink(newfile);
+	return 0;
+    }
+    (void)close(fd);
+    hc.dev = st.st_dev;
+    hc.ino = st.st_ino;
+    hc.loaded = len;
+    return 1;
+}
+
+/**
+ * Prepare the cache for \p header ("Name:") in the current group
+ * directory, reading what was added since the last call.
+ * \return 0 if the header cannot be cached
+ */
+int
+hdrcache_open(const char *header)
+{
+    struct stat ov, dir, st;
+    size_t len = strcspn(header, ":");
+    size_t i;
+    int fd;
+
+    if (!len || len > HDRCACHE_NAMEMAX)
+	return 0;
+    for (i = 0; i < len; i++) {
+	if (!isalnum((unsigned char)header[i]) && header[i] != '-')
+	    return 0;
+    }
+    if (stat(".overview", &ov) || stat(".", &dir))
+	return 0;
+    if (!hc.pending)
+	hc.pending = mastr_new(1024);
+    mastr_clear(hc.pending);
+    hc.active = 1;
+    hc.usable = 1;
+
+    if (dir.st_dev != hc.dirdev || dir.st_ino != hc.dirino
+	    || strncasecmp(hc.name + 10, header, len) || hc.name[10 + len]) {
+	hc_reset();
+	hc.dirdev = dir.st_dev;
+	hc.dirino = dir.st_ino;
+	(void)strcpy(hc.name, ".hdrcache.");
+	for (i = 0; i < len; i++)
+	    hc.name[10 + i] = (char)tolower((unsigned char)header[i]);
+	hc.name[10 + len] = '\0';
+    }
+
+    if ((fd = open(hc.name, O_RDONLY)) < 0 && errno == ENOENT
+	    && hc_count() >= HDRCACHE_MAX) {
+	hc.active = 0;
+	return 0;
+    }
+    if (fd < 0 || fstat(fd, &st)
+	    || st.st_dev != hc.dev || st.st_ino != hc.ino
+	    || st.st_size < hc.loaded) {
+	/* not the file we read before */
+	hc_reset();
+    }
+    if (fd < 0 || !hc_load(fd, ov.st_ino)) {
+	hc.usable = hc_create(ov.st_ino);
+    } else if (!hc.ino) {
+	hc.dev = st.st_dev;
+	hc.ino = st.st_ino;
+    }
+    if (fd >= 0)
+	(void)close(fd);
+    return 1;
+}
+
+/**
+ * Look up the cached value of the header for \p artno.
+ * \return 1 with the value in *\p val, 0 if the article lacks the
+ * header, -1 if it is not cached
+ */
+int
+hdrcache_get(unsigned long artno, /*@out@*/ const char **val)
+{
+    struct hcent key, *e;
+
+    if (!hc.active)
+	return -1;
+    if (!hc.sorted) {
+	ln_sort(hc.ent, hc.n, sizeof(struct hcent), _comphcent);
+	hc.sorted = 1;
+    }
+    key.artno = artno;
+    e = (struct hcent *)bsearch(&key, hc.ent, hc.n, sizeof(struct hcent),
+	    _comphcent);
+    if (!e)
+	return -1;
+    if (e->val == HC_ABSENT)
+	return 0;
+    *val = hc.vals + e->val;
+    return 1;
+}
+
+/** Remember \p val as the header of \p artno, NULL if it lacks it.
+ * The value becomes visible to hdrcache_get() after hdrcache_close(),
+ * each article is looked up once per request anyway. */
+void
+hdrcache_put(unsigned long artno, /*@null@*/ const char *val)
+{
+    char num[32];
+
+    if (!hc.active)
+	return;
+    (void)snprintf(num, sizeof(num), "%lu", artno);
+    (void)mastr_cat(hc.pending, num);
+    if (val) {
+	char *v = critstrdup(val, "hdrcache_put"), *p;
+
+	/* one line per article */
+	for (p = v; *p; p++) {
+	    if (*p == '\n' || *p == '\r')
+		*p = ' ';
+	}
+	(void)mastr_vcat(hc.pending, "\t", v, NULL);
+	free(v);
+    }
+    (void)mastr_cat(hc.pending, "\n");
+}
+
+/** Append the values added by hdrcache_put() to the cache file. */
+void
+hdrcache_close(void)
+{
+    struct stat st;
+    size_t len;
+    int fd;
+
+    if (!hc.active)
+	return;
+    hc.active = 0;
+    len = mastr_len(hc.pending);
+    if (!len || !hc.usable)
+	return;
+    if ((fd = open(hc.name, O_WRONLY | O_APPEND)) < 0)
+	return;
+    if (fstat(fd, &st) == 0 && st.st_dev == hc.dev && st.st_ino == hc.ino) {
+	if (write(fd, mastr_str(hc.pending), len) != (ssize_t)len) {
+	    ln_log(LNLOG_SERR, LNLOG_CGROUP, "cannot write %s/%s: %m",
+		    sgetcwd(), hc.name);
+	} else if (lseek(fd, 0, SEEK_CUR) == hc.loaded + (off_t)len) {
+	    /* nobody else appended, take our lines without reading
+	     * them back */
+	    char *l = mastr_modifyable_str(hc.pending), *q;
+
+	    for (; (q = strchr(l, '\n')); l = q + 1) {
+		*q = '\0';
+		hc_parseline(l);
+	    }
+	    hc.loaded += (off_t)len;
+	}
+    }
+    (void)close(fd);
+    mastr_clear(hc.pending);
+}
+
+/** Remove the header caches of the current group directory. */
+void
+hdrcache_remove(void)
+{
+    DIR *d;
+    struct dirent *de;
+
+    if (!(d = opendir(".")))
+	return;
+    while ((de = readdir(d))) {
+	if (!strncmp(de->d_name, ".hdrcache.", 10) && unlink(de->d_name))
+	    ln_log(LNLOG_SERR, LNLOG_CGROUP, "cannot unlink %s/%s: %m",
+		    sgetcwd(), de->d_name);
+    }
+    (void)closedir(d);
+    hc.dirdev = 0;
+    hc.dirino = 0;
+}
@@ -0,0 +1,10 @@
+#ifndef HDRCACHE_H
+#define HDRCACHE_H
+
+int hdrcache_open(const char *header);
+int hdrcache_get(unsigned long artno, /*@out@*/ const char **val);
+void hdrcache_put(unsigned long artno, /*@null@*/ const char *val);
+void hdrcache_close(void);
+void hdrcache_remove(void);
+
+#endif
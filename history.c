@@ -0,0 +1,517 @@
+/** \file history.c
+ * Message-ID history.
+ *
+ * fetchnews asks for every Message-ID in an XOVER or XHDR listing
+ * whether we already have the article. Rather than stat()ing the
+ * message.id file each time, we keep $(SPOOLDIR)/leaf.node/history,
+ * an append-only file of fixed-size binary records:
+ *
+ *   64-bit hash of the sanitized Message-ID, 32-bit time, 32-bit state
+ *
+ * The first record is a header carrying HIST_MAGIC. A later record for
+ * the same hash supersedes an earlier one. The file is mapped and
+ * replayed into an open-addressing hash table in memory once per
+ * process, lookups are then done without system calls.
+ *
+ * store() appends HIST_PRESENT, delete_article() appends HIST_EXPIRED.
+ * texpire rewrites the file from its scan of message.id, which also
+ * creates it on spools that do not have one yet, and keeps expired
+ * Message-IDs for as long as articles are kept, so that fetchnews does
+ * not fetch expired or cancelled articles again. Writers hold the
+ * lock file, so the rewrite does not lose records appended by others.
+ *
+ * Until texpire has created the history, history_have() builds a
+ * Bloom filter from the file names in message.id, so that only the
+ * Message-IDs the filter cannot rule out cost a stat().
+ *
+ * The history is only a hint for fetchnews: store() still checks the
+ * message.id directory, so a stale history can cause at worst an
+ * unneeded download or a missed article that has vanished from the
+ * spool without texpire or delete_article() noticing.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+#include "critmem.h"
+#include "ln_log.h"
+#include "mastring.h"
+#include "msgid.h"
+#include "history.h"
+#include "system.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+/** key of the header record, "LNHIST01" in ASCII */
+#define HIST_MAGIC 0x4c4e484953543031ULL
+/** file format version, stored in the header record */
+#define HIST_VERSION 1
+
+struct histrec {
+    uint64_t key;		/* FNV-1a hash of the Message-ID, never 0 */
+    uint32_t when;		/* time of the last state change */
+    uint32_t state;		/* HIST_PRESENT or HIST_EXPIRED */
+};
+
+struct histtab {
+    /*@null@*/ /*@only@*/ struct histrec *slot;
+    unsigned long size;		/* number of slots, a power of two */
+    unsigned long used;		/* number of slots with a key */
+};
+
+static struct histtab live;	/* the history file and our own notes */
+static int loaded;		/* 0: not tried, 1: live valid, -1: no file */
+static struct histtab fresh;	/* being built by texpire */
+
+/** Bloom filter used in place of a missing history file */
+#define BLOOM_K 4
+#define BLOOM_BITS_PER_KEY 16
+/*@null@*/ /*@only@*/ static unsigned char *bloom;
+static unsigned long bloombits;	/* a power of two */
+static int bloomstate;		/* 0: not tried, 1: valid, -1: unusable */
+
+struct history_stats history_stats;
+
+/*@dependent@*/ static const char *
+histfile(void)
+{
+    static mastr *name;
+
+    if (!name) {
+	name = mastr_new(LN_PATH_MAX);
+	(void)mastr_vcat(name, spooldir, "/leaf.node/history", NULL);
+    }
+    return mastr_str(name);
+}
+
+/** hash a Message-ID the way lookup() sanitizes it, so that file
+ * names in message.id hash to the same key as the Message-ID */
+static uint64_t
+histkey(const char *mid)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (; *mid; mid++) {
+	unsigned char c = (unsigned char)(*mid == '/' ? '@' : *mid);
+
+	h ^= c;
+	h *= 0x100000001b3ULL;
+	if (c == '>')
+	    break;
+    }
+    return h ? h : 1;
+}
+
+/** \return the slot holding \p key, or the empty slot where it
+ * belongs */
+static struct histrec *
+tab_slot(const struct histtab *t, uint64_t key)
+{
+    unsigned long i = (unsigned long)key & (t->size - 1);
+
+    while (t->slot[i].key && t->slot[i].key != key)
+	i = (i + 1) & (t->size - 1);
+    return &t->slot[i];
+}
+
+/** resize \p t to at least \p want slots */
+static void
+tab_resize(struct histtab *t, unsigned long want)
+{
+    struct histtab n;
+    unsigned long i;
+
+    n.size = 1024;
+    while (n.size < want)
+	n.size *= 2;
+    n.slot = (struct histrec *)critcalloc(n.size * sizeof(struct histrec),
+	    "tab_resize");
+    n.used = t->used;
+    for (i = 0; i < t->size; i++)
+	if (t->slot[i].key)
+	    *tab_slot(&n, t->slot[i].key) = t->slot[i];
+    free(t->slot);
+    *t = n;
+}
+
+static void
+tab_put(struct histtab *t, uint64_t key, uint32_t when, uint32_t state)
+{
+    struct histrec *r;
+
+    /* keep the load factor at or below 1/2 */
+    if (2 * (t->used + 1) > t->size)
+	tab_resize(t, 2 * (t->used + 1));
+    r = tab_slot(t, key);
+    if (!r->key) {
+	r->key = key;
+	t->used++;
+    }
+    r->when = when;
+    r->state = state;
+}
+
+static void
+tab_free(struct histtab *t)
+{
+    free(t->slot);
+    t->slot = NULL;
+    t->size = t->used = 0;
+}
+
+/** replay the history file into \p t.
+ * \return 0 for success, -1 if the file is missing or unusable */
+static int
+tab_read(struct histtab *t)
+{
+    const char *name = histfile();
+    const struct histrec *r;
+    struct stat st;
+    unsigned long n, i;
+    void *map;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY)) < 0) {
+	if (errno != ENOENT)
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot open %s: %m", name);
+	return -1;
+    }
+    if (fstat(fd, &st)) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot stat %s: %m", name);
+	(void)close(fd);
+	return -1;
+    }
+    /* a torn record at the end is ignored */
+    n = (unsigned long)(st.st_size / sizeof(struct histrec));
+    if (n == 0) {
+	ln_log(LNLOG_SWARNING, LNLOG_CTOP, "%s is empty, ignored", name);
+	(void)close(fd);
+	return -1;
+    }
+    map = mmap(NULL, n * sizeof(struct histrec), PROT_READ, MAP_SHARED,
+	    fd, 0);
+    (void)close(fd);
+    if (map == MAP_FAILED) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot mmap %s: %m", name);
+	return -1;
+    }
+    r = (const struct histrec *)map;
+    if (r[0].key != HIST_MAGIC || r[0].when != HIST_VERSION) {
+	ln_log(LNLOG_SWARNING, LNLOG_CTOP,
+		"%s has an unknown format, ignored", name);
+	(void)munmap(map, n * sizeof(struct histrec));
+	return -1;
+    }
+    tab_resize(t, 2 * n);
+    for (i = 1; i < n; i++)
+	if (r[i].key)
+	    tab_put(t, r[i].key, r[i].when, r[i].state);
+    (void)munmap(map, n * sizeof(struct histrec));
+    return 0;
+}
+
+/** \return 1 if the history is available in memory */
+static int
+history_load(void)
+{
+    if (!loaded)
+	loaded = tab_read(&live) ? -1 : 1;
+    return loaded > 0;
+}
+
+/** set the BLOOM_K bits of \p key, or with \p test set, check them.
+ * \return 1 if all bits are (now) set */
+static int
+bloom_bits(uint64_t key, int test)
+{
+    uint64_t b = (key >> 33) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_K; i++, key += b) {
+	unsigned long bit = (unsigned long)key & (bloombits - 1);
+
+	if (!test)
+	    bloom[bit / CHAR_BIT] |= (unsigned char)(1 << (bit % CHAR_BIT));
+	else if (!(bloom[bit / CHAR_BIT] & (1 << (bit % CHAR_BIT))))
+	    return 0;
+    }
+    return 1;
+}
+
+/** build the Bloom filter from the file names in message.id.
+ * \return 1 if the filter is usable */
+static int
+bloom_load(void)
+{
+    uint64_t *keys = NULL;
+    unsigned long nkeys = 0, maxkeys = 0, i, n = 0;
+    const struct msgid_layout *l = msgid_layout(0);
+    mastr *s;
+
+    if (bloomstate)
+	return bloomstate > 0;
+    bloomstate = -1;
+    if (!l)
+	return 0;
+
+    s = mastr_new(LN_PATH_MAX);
+    /* the current layout, then the one a rehash is moving from */
+    for (;; n++) {
+	struct dirent *de;
+	DIR *d;
+
+	if (n == msgid_layout_dirs(l)) {
+	    if (l != msgid_layout(0) || !(l = msgid_layout(1)))
+		break;
+	    n = 0;
+	}
+	msgid_layout_dir(s, l, n);
+	if (!(d = opendir(mastr_str(s)))) {
+	    if (errno == ENOENT)
+		continue;
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot open directory %s: %m",
+		    mastr_str(s));
+	    free(keys);
+	    mastr_delete(s);
+	    return 0;
+	}
+	while ((de = readdir(d))) {
+	    if (de->d_name[0] == '.')
+		continue;
+	    if (nkeys == maxkeys) {
+		maxkeys = maxkeys ? 2 * maxkeys : 4096;
+		keys = (uint64_t *)critrealloc((char *)keys,
+			maxkeys * sizeof(uint64_t), "bloom_load");
+	    }
+	    keys[nkeys++] = histkey(de->d_name);
+	}
+	(void)closedir(d);
+    }
+    mastr_delete(s);
+
+    bloombits = 65536;
+    while (bloombits < BLOOM_BITS_PER_KEY * nkeys)
+	bloombits *= 2;
+    bloom = (unsigned char *)critcalloc(bloombits / CHAR_BIT, "bloom_load");
+    for (i = 0; i < nkeys; i++)
+	(void)bloom_bits(keys[i], 0);
+    free(keys);
+    ln_log(LNLOG_SINFO, LNLOG_CTOP,
+	    "history: no history file, using a filter of %lu bits for %lu "
+	    "Message-IDs", bloombits, nkeys);
+    bloomstate = 1;
+    return 1;
+}
+
+/** check if we have or recently had the articles with the \p n
+ * Message-IDs in \p mids, setting \p have[i] to 1 if mids[i] is
+ * present or was expired or cancelled, and to 0 if it is unknown or
+ * NULL. Without a history file, a Bloom filter of the message.id
+ * directory answers for the Message-IDs we definitely do not have,
+ * and ihave_batch() checks the rest. */
+void
+history_have_batch(const char *const *mids, size_t n, char *have)
+{
+    const char **maybe;
+    size_t *where, i, m = 0;
+    char *mhave;
+
+    if (history_load()) {
+	for (i = 0; i < n; i++) {
+	    have[i] = 0;
+	    if (!mids[i] || !*mids[i])
+		continue;
+	    history_stats.lookups++;
+	    history_stats.avoided++;
+	    have[i] = tab_slot(&live, histkey(mids[i]))->key != 0;
+	    history_stats.hits += have[i];
+	}
+	return;
+    }
+    if (!bloom_load()) {
+	for (i = 0; i < n; i++)
+	    history_stats.lookups += mids[i] && *mids[i];
+	ihave_batch(mids, n, have);
+	return;
+    }
+
+    maybe = (const char **)critmalloc(n * sizeof(*maybe) + 1,
+	    "history_have_batch");
+    where = (size_t *)critmalloc(n * sizeof(*where) + 1,
+	    "history_have_batch");
+    for (i = 0; i < n; i++) {
+	have[i] = 0;
+	if (!mids[i] || !*mids[i])
+	    continue;
+	history_stats.lookups++;
+	if (!bloom_bits(histkey(mids[i]), 1)) {
+	    history_stats.avoided++;
+	    continue;
+	}
+	history_stats.hits++;
+	maybe[m] = mids[i];
+	where[m++] = i;
+    }
+    mhave = (char *)critmalloc(m + 1, "history_have_batch");
+    ihave_batch(maybe, m, mhave);
+    for (i = 0; i < m; i++) {
+	have[where[i]] = mhave[i];
+	if (!mhave[i])
+	    history_stats.falsepos++;
+    }
+    free(mhave);
+    free(where);
+    free(maybe);
+}
+
+/** check if we have or recently had an article, see
+ * history_have_batch().
+ * \return
+ * - 0 if the article is unknown or mid is NULL
+ * - 1 if the article is present or was expired or cancelled */
+int
+history_have(/*@null@*/ const char *mid)
+{
+    char r;
+
+    history_have_batch(&mid, 1, &r);
+    return r;
+}
+
+/** record a new \p state for \p mid. Nothing is written if the
+ * history file does not exist, texpire creates it. */
+void
+history_note(/*@null@*/ const char *mid, int state)
+{
+    const char *name = histfile();
+    struct histrec r;
+    int fd;
+
+    if (!mid || !*mid)
+	return;
+    r.key = histkey(mid);
+    r.when = (uint32_t)time(NULL);
+    r.state = (uint32_t)state;
+    if (loaded > 0)
+	tab_put(&live, r.key, r.when, r.state);
+    else if (bloomstate > 0 && state == HIST_PRESENT)
+	(void)bloom_bits(r.key, 0);
+
+    if ((fd = open(name, O_WRONLY | O_APPEND)) < 0) {
+	if (errno != ENOENT)
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot open %s: %m", name);
+	return;
+    }
+    /* a single write to an O_APPEND file, records do not interleave */
+    if (write(fd, &r, sizeof(r)) != (ssize_t)sizeof(r))
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot append to %s: %m", name);
+    (void)close(fd);
+}
+
+/** start a history rewrite, to be fed with history_rebuild_note() */
+void
+history_rebuild_begin(void)
+{
+    tab_free(&fresh);
+    tab_resize(&fresh, 0);
+}
+
+/** record the state of message.id file \p name in the new history */
+void
+history_rebuild_note(const char *name, int state, time_t when)
+{
+    tab_put(&fresh, histkey(name), (uint32_t)when, (uint32_t)state);
+}
+
+/** merge the old history into the new one and replace the file.
+ * Expired Message-IDs are kept if they expired at or after \p
+ * keep_expired_since. Articles the old history believed present that
+ * have not been noted are taken as expired now.
+ * \return 0 for success, -1 for error */
+int
+history_rebuild_commit(time_t keep_expired_since)
+{
+    const char *name = histfile();
+    struct histtab old;
+    struct histrec hdr;
+    mastr *tmp;
+    FILE *f = NULL;
+    unsigned long i;
+    uint32_t now = (uint32_t)time(NULL);
+    int fd, rc = 0;
+
+    old.slot = NULL;
+    old.size = old.used = 0;
+    if (tab_read(&old) == 0) {
+	for (i = 0; i < old.size; i++) {
+	    const struct histrec *o = &old.slot[i];
+
+	    if (!o->key || tab_slot(&fresh, o->key)->key)
+		continue;
+	    if (o->state == HIST_PRESENT)
+		tab_put(&fresh, o->key, now, HIST_EXPIRED);
+	    else if ((time_t)o->when >= keep_expired_since)
+		tab_put(&fresh, o->key, o->when, o->state);
+	}
+    }
+    tab_free(&old);
+
+    tmp = mastr_new(LN_PATH_MAX);
+    (void)mastr_vcat(tmp, name, ".XXXXXXXXXX", NULL);
+    if ((fd = safe_mkstemp(mastr_modifyable_str(tmp))) < 0
+	    || !(f = fdopen(fd, "w"))) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot create %s: %m",
+		mastr_str(tmp));
+	if (fd >= 0) {
+	    (void)close(fd);
+	    (void)unlink(mastr_str(tmp));
+	}
+	mastr_delete(tmp);
+	return -1;
+    }
+    (void)fchmod(fd, 0660);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.key = HIST_MAGIC;
+    hdr.when = HIST_VERSION;
+    (void)fwrite(&hdr, sizeof(hdr), 1, f);
+    for (i = 0; i < fresh.size; i++)
+	if (fresh.slot[i].key)
+	    (void)fwrite(&fresh.slot[i], sizeof(struct histrec), 1, f);
+    if (fflush(f) || ferror(f) || log_fsync(fd)
+	    || rename(mastr_str(tmp), name)) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot write %s: %m", name);
+	(void)unlink(mastr_str(tmp));
+	rc = -1;
+    }
+    (void)fclose(f);
+    mastr_delete(tmp);
+
+    if (rc == 0) {
+	ln_log(LNLOG_SINFO, LNLOG_CTOP, "history: %lu Message-IDs",
+		fresh.used);
+	tab_free(&live);
+	live = fresh;
+	loaded = 1;
+    } else {
+	tab_free(&fresh);
+    }
+    fresh.slot = NULL;
+    fresh.size = fresh.used = 0;
+    return rc;
+}
@@ -0,0 +1,27 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/** states of a history record */
+#define HIST_PRESENT 1		/**< article is in the spool */
+#define HIST_EXPIRED 2		/**< article was expired or cancelled */
+
+/** counters for the fetchnews run summary */
+struct history_stats {
+    unsigned long lookups;	/**< history_have() calls */
+    unsigned long hits;		/**< history or filter knew the Message-ID */
+    unsigned long falsepos;	/**< filter hits that ihave() refuted */
+    unsigned long avoided;	/**< lookups answered without stat() */
+};
+extern struct history_stats history_stats;
+
+int history_have(/*@null@*/ const char *mid);
+void history_have_batch(const char *const *mids, size_t n, char *have);
+void history_note(/*@null@*/ const char *mid, int state);
+void history_rebuild_begin(void);
+void history_rebuild_note(const char *name, int state, time_t when);
+int history_rebuild_commit(time_t keep_expired_since);
+
+#endif
@@ -314,6 +314,8 @@ int readfilter(/*@null@*/ const char *filterfile)
 int store_stream(FILE * stream, int, /*@null@*/ const struct filterlist *,
 	ssize_t, int);
 /*@observer@*/ const char *store_err(int);
+void store_batch_begin(void);
+int store_batch_commit(void);
 
 /*
  * find a certain header in an article and return it
@@ -338,14 +340,19 @@ void delete_article(
 	const char *msgid,	/**< Message-ID, including angle brackets */
 	const char *present,	/**< Action, infinitive */
 	const char *past,	/**< Action, past tense */
-	const int   updatexover	/**< if set, update .overview data */);
+	const int   updatexover	/**< if set, compact .overview data in
+				  delete_article_flush() */);
+/** Rewrite the .overview files of the groups that delete_article()
+ * removed articles from with updatexover set, if their
+ * .overview.deleted has grown large. */
+void delete_article_flush(void);
 
 /*
  * xover stuff -- for nntpd.c
  */
 struct xoverinfo {
     unsigned long artno;
-    char *text;
+    char *text;		/* owned by xoverutil.c, do not free */
     int exists;
 };
 
@@ -363,10 +370,32 @@ enum xoverfields {
     XO_REFERENCES,
     XO_BYTES,
     XO_LINES,
-    XO_XREF
+    XO_XREF,
+    XO_EXTRA	/* first header from overview_headers */
 };
+#define XO_MAXEXTRA 8	/* headers that overview_headers may add */
+
+/** overview data collected from header lines, see xoverbuild_*() */
+struct xoverbuild {
+    char *field[XO_EXTRA + XO_MAXEXTRA];	/* header values, NULL if not seen */
+    char *cur;			/* header line being collected */
+    size_t curlen;
+    size_t cursize;
+    enum xoverfields curfield;	/* field of cur, XO_ERR if ignored */
+    long hbytes;		/* Bytes: header, -1 if none */
+    long hlines;		/* Lines: header, -1 if none */
+};
+
+void xoverbuild_init(/*@out@*/ struct xoverbuild *);
+void xoverbuild_header(struct xoverbuild *, const char *line);
+/*@null@*/ /*@only@*/ char *xoverbuild_line(struct xoverbuild *,
+	const char *artno, long bytes, long lines);
+void xoverbuild_free(struct xoverbuild *);
 
 extern enum xoverfields matchxoverfield(const char *header);
+void xoverextra_set(const char *headers);
+/*@observer@*/ const char *xoverextra_name(int k);
+extern int xoverextras;	/* number of headers from overview_headers */
 /*@null@*/ /*@dependent@*/
 char *getxoverfield(char *xoverline, enum xoverfields);
 /*@null@*/ /*@only@*/ char * getxoverline(const int, const char *const);
@@ -375,6 +404,7 @@ extern struct xoverinfo *xoverinfo;
 extern unsigned long xfirst;
 extern unsigned long xlast;
 extern unsigned long xcount;
+extern unsigned long xovergen;	/* changes when entries are removed or reordered */
 long findxover(unsigned long article);
 int findxoverrange(unsigned long low, unsigned long high,
 	/*@out@*/ long *idxlow, /*@out@*/ long *idxhigh);
@@ -383,6 +413,15 @@ int findxoverrange(unsigned long low, unsigned long high,
 int maybegetxover(/*@null@*/ struct newsgroup *g);
 /* set xoverinfo, return 0 on error, nonzero else, fill in water marks */
 int xgetxover(const int, /*@null@*/ struct newsgroup *g, const int);
+/* map .overview and .overview.index, for nntpd */
+int xmapxover(/*@null@*/ struct newsgroup *g);
+unsigned long xoverartno(unsigned long i);
+/*@null@*/ /*@dependent@*/ const char *xoverline(unsigned long i,
+	/*@out@*/ size_t *len);
+/*@null@*/ /*@dependent@*/ const char *xoverfield(unsigned long i,
+	enum xoverfields f, /*@out@*/ size_t *len);
+int xoverheader(unsigned long i, enum xoverfields f,
+	/*@out@*/ const char **val, /*@out@*/ size_t *len);
     /* set xoverinfo, return 0 on error, nonzero else, fill in water marks */
     void freexover(void);	/* free xoverinfo structure */
     extern int writexover(void);    /* write overview info */
@@ -463,6 +502,9 @@ extern int delaybody;	/* delay download of message body */
 extern int debugmode;	/* log lots of stuff via syslog */
 extern int no_direct_spool; /* if set, do not store remote posts locally */
 extern long windowsize;
+extern long receive_queue;	/* see config.example */
+extern unsigned long msgid_buckets;	/* see config.example */
+extern unsigned long xpat_index;	/* see config.example */
 /* Note: Sync the DEBUG_ flags below with config.example */
 #define DEBUG_LOGGING 1
 #define DEBUG_IO   2
@@ -639,6 +681,15 @@ int log_moveto(/*@notnull@*/ const char *, const char *dir);
 
 /* from wildmat.c */
 int wildmat(const char *text, const char *p);
+struct wildpat;
+/*@only@*/ struct wildpat *wildpat_compile(const char *p);
+/*@null@*/ /*@only@*/ struct wildpat *wildpat_compilelist(const struct stringlistnode *a);
+void wildpat_free(/*@null@*/ /*@only@*/ struct wildpat *w);
+int wildpat_match(/*@null@*/ const struct wildpat *w, const char *text, size_t len);
+/*@observer@*/ const struct wildpat *wildpat_cached(const char *p);
+/*@null@*/ /*@observer@*/ const struct wildpat *wildpat_next(const struct wildpat *w);
+size_t wildpat_literals(const struct wildpat *w, size_t min,
+	/*@out@*/ const char **run, /*@out@*/ size_t *len, size_t max);
 
 /* from lockfile.c */
 int safe_mkstemp(char *templ);
@@ -686,6 +737,7 @@ time_t gmtoff(const time_t);
 
 /* getwatermarks.c */
 int getwatermarks(unsigned long *, unsigned long *, unsigned long /*@null@*/ *);
+int getwatermarksat(int, unsigned long *, unsigned long *, unsigned long /*@null@*/ *);
 
 /* touch.c */
 int touch_truncate(const char *name);
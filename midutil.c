@@ -11,41 +11,71 @@
 #include <errno.h>
 #include <unistd.h>
 
-/* WARNING: THIS FUNCTION RETURNS A VALUE FROM A STATIC BUFFER */
-/*@dependent@*/ char *
-lookup(/*@null@*/ const char *msgid)
+/** format the path of \p msgid in layout \p l into \p *name, which
+ * is grown as needed */
+static char *
+layout_lookup(char **name, unsigned int *namelen,
+	const struct msgid_layout *l, const char *msgid)
 {
-    static /*@null@*/ /*@owned@*/ char *name = NULL;
-    static unsigned int namelen = 0;
-    unsigned int r;
     unsigned int i;
     char *p;
     const char *const myname = "lookup";
 
-    if (!msgid || !*msgid)
-	return NULL;
-
     i = strlen(msgid) + strlen(spooldir) + 30;
 
-    if (!name) {
-	name = (char *)critmalloc(i, myname);
-	namelen = i;
-    } else if (i > namelen) {
-	name = (char *)critrealloc(name, i, myname);
-	namelen = i;
+    if (!*name) {
+	*name = (char *)critmalloc(i, myname);
+	*namelen = i;
+    } else if (i > *namelen) {
+	*name = (char *)critrealloc(*name, i, myname);
+	*namelen = i;
     }
 
     /** \bug When fixing this, make sure we don't have a period as the
      * last character (breaks NTFS on CygWin) and heed POSIX portable
      * file name character set
      */
-    p = mastrcpy(name, spooldir);
+    p = mastrcpy(*name, spooldir);
     p = mastrcpy(p, "/message.id/");
-    (void)mastrcpy(p + 4, msgid);
-    msgid_sanitize(p + 4);
-    r = msgid_hash(p + 4);
-    str_ulong0(p, r, 3);
-    p[3] = '/';
+    (void)mastrcpy(p + MSGID_DIRLEN(l), msgid);
+    msgid_sanitize(p + MSGID_DIRLEN(l));
+    msgid_layout_path(p, l);
+    return *name;
+}
+
+/* WARNING: THIS FUNCTION RETURNS A VALUE FROM A STATIC BUFFER */
+/** \return the message.id path of \p msgid in layout \p l */
+/*@dependent@*/ char *
+lookup_layout(const struct msgid_layout *l, const char *msgid)
+{
+    static /*@null@*/ /*@owned@*/ char *name = NULL;
+    static unsigned int namelen = 0;
+
+    return layout_lookup(&name, &namelen, l, msgid);
+}
+
+/* WARNING: THIS FUNCTION RETURNS A VALUE FROM A STATIC BUFFER */
+/** \return the message.id path of \p msgid, or NULL if \p msgid is
+ * empty or the spool layout is unknown. While texpire -H rehashes
+ * the spool, this is the path in the previous layout if the article
+ * has not been moved yet. */
+/*@dependent@*/ char *
+lookup(/*@null@*/ const char *msgid)
+{
+    static /*@null@*/ /*@owned@*/ char *name = NULL, *oldname = NULL;
+    static unsigned int namelen = 0, oldnamelen = 0;
+    const struct msgid_layout *cur, *prev;
+    struct stat st;
+
+    if (!msgid || !*msgid || !(cur = msgid_layout(0)))
+	return NULL;
+
+    (void)layout_lookup(&name, &namelen, cur, msgid);
+    if ((prev = msgid_layout(1)) && stat(name, &st) && errno == ENOENT) {
+	(void)layout_lookup(&oldname, &oldnamelen, prev, msgid);
+	if (0 == stat(oldname, &st))
+	    return oldname;
+    }
     return name;
 }
 
@@ -72,6 +102,100 @@ ihave(/*@null@*/ const char *mid
     return 0;
 }
 
+/** ihave_batch() reads a message.id directory rather than stat()ing
+ * its candidates if the directory is at most this many bytes per
+ * candidate; one stat() is about as expensive as reading a kilobyte
+ * of directory entries. */
+#define IHAVE_DIRBYTES_PER_STAT 1024
+
+struct ihave_cand {
+    char *path;			/* message.id path */
+    size_t base;		/* offset of the file name in path */
+    size_t idx;			/* index into the caller's arrays */
+};
+
+static int
+cmp_cand(const void *a, const void *b)
+{
+    return strcmp(((const struct ihave_cand *)a)->path,
+	    ((const struct ihave_cand *)b)->path);
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/** check if we have the articles with the \p n Message-IDs in \p
+ * mids, setting \p have[i] to 1 if we have mids[i] and to 0 if not.
+ * The Message-IDs are grouped by message.id directory, and directories
+ * that are small compared to the number of their candidates are read
+ * once instead of stat()ing each candidate. */
+void
+ihave_batch(const char *const *mids, size_t n, char *have)
+{
+    const struct msgid_layout *l = msgid_layout(0);
+    struct ihave_cand *c;
+    struct stat st;
+    size_t i, j, k, m = 0;
+
+    if (!l) {
+	memset(have, 0, n);
+	return;
+    }
+    c = (struct ihave_cand *)critmalloc(n * sizeof(*c) + 1, "ihave_batch");
+    for (i = 0; i < n; i++) {
+	have[i] = 0;
+	if (!mids[i] || !*mids[i])
+	    continue;
+	c[m].path = critstrdup(lookup_layout(l, mids[i]), "ihave_batch");
+	c[m].base = strrchr(c[m].path, '/') - c[m].path + 1;
+	c[m].idx = i;
+	m++;
+    }
+    /* the directory part has the same length for all paths */
+    qsort(c, m, sizeof(*c), cmp_cand);
+
+    for (i = 0; i < m; i = j) {
+	char **names = NULL;
+	unsigned long count = 0;
+
+	for (j = i + 1; j < m && !strncmp(c[i].path, c[j].path, c[i].base);
+		j++)
+	    ;
+	c[i].path[c[i].base - 1] = '\0';
+	if (j - i > 1 && 0 == stat(c[i].path, &st)
+		&& (unsigned long)st.st_size / IHAVE_DIRBYTES_PER_STAT
+		    <= (unsigned long)(j - i)
+		&& (names = dirlist(c[i].path, DIRLIST_NONDOT, &count)))
+	    qsort(names, count, sizeof(char *), cmp_name);
+	c[i].path[c[i].base - 1] = '/';
+
+	for (k = i; k < j; k++) {
+	    const char *f = c[k].path + c[k].base;
+
+	    if (names)
+		have[c[k].idx] = bsearch(&f, names, count, sizeof(char *),
+			cmp_name) != NULL;
+	    else
+		have[c[k].idx] = 0 == stat(c[k].path, &st)
+		    && S_ISREG(st.st_mode);
+	}
+	free_dirlist(names);
+    }
+
+    for (i = 0; i < m; i++)
+	free(c[i].path);
+    free(c);
+
+    /* articles that texpire -H has not moved yet */
+    if (msgid_layout(1))
+	for (i = 0; i < n; i++)
+	    if (!have[i])
+		have[i] = ihave(mids[i]);
+}
+
 /** atomically allocate a Message-ID unless it's already present.
  * to avoid texpire nuking the file right away, you must give another
  * file name that is linked into the Message-ID directory.
@@ -85,6 +209,10 @@ msgid_allocate(const char *file /** file to link into message.id */,
 	const char *mid /** Non-NULL Message-ID to allocate */)
 {
     char *m = lookup(mid);
+    if (!m) {
+	errno = EINVAL;
+	return -1;
+    }
     if (mkdir_parent(m, 0700))
 	return 0;
     if (sync_link(file, m) == 0) {
@@ -101,6 +229,6 @@ msgid_deallocate(const char *file /** file linked into message.id */,
 {
     const char *m = lookup(mid);
     int r1 = log_unlink(file, 0);
-    int r2 = log_unlink(m, 0);
+    int r2 = m ? log_unlink(m, 0) : -1;
     return min(r1, r2);
 }
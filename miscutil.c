@@ -789,7 +789,7 @@ rfctime(void)
 int
 ngmatch(const char *pattern, const char *str)
 {
-    int r = wildmat(str, pattern);
+    int r = wildpat_match(wildpat_cached(pattern), str, strlen(str));
 #if 0
     if (debugmode & DEBUG_MISC) {
 	ln_log(LNLOG_SDEBUG, LNLOG_CTOP, "ngmatch(pattern = \"%s\", "
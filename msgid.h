@@ -1,11 +1,37 @@
 #ifndef MSGID_H
 #define MSGID_H
 
+#include "mastring.h"
+
+/** layout of the message.id directory, see msgid_layout.c */
+struct msgid_layout {
+    int version;		/**< 1: msgid_hash(), 2: SipHash buckets */
+    unsigned long buckets;	/**< number of leaf directories */
+    unsigned char key[16];	/**< SipHash key, version 2 only */
+};
+
+/** most buckets a version 2 layout can have */
+#define MSGID_MAXBUCKETS 1000000UL
+/** length of the leaf directory part of a message.id path, with slash */
+#define MSGID_DIRLEN(l) ((l)->version == 1 ? 4 : 8)
+
 void msgid_sanitize(char *m);
 unsigned int msgid_hash(const char *name);
 /*@dependent@*/ char *lookup(/*@null@*/ const char *msgid);
+/*@dependent@*/ char *lookup_layout(const struct msgid_layout *l,
+	const char *msgid);
 /*@falsewhennull@*/ int ihave(/*@null@*/ const char *mid);
+void ihave_batch(const char *const *mids, size_t n, char *have);
 int msgid_allocate(const char *file, const char *mid);
 int msgid_deallocate(const char *file, const char *mid);
 
+/*@observer@*/ /*@null@*/ const struct msgid_layout *msgid_layout(int previous);
+void msgid_layout_new(struct msgid_layout *l, unsigned long buckets);
+int msgid_layout_set(const struct msgid_layout *l,
+	/*@null@*/ const struct msgid_layout *previous);
+unsigned long msgid_layout_dirs(const struct msgid_layout *l);
+void msgid_layout_dir(mastr *s, const struct msgid_layout *l,
+	unsigned long n);
+void msgid_layout_path(char *p, const struct msgid_layout *l);
+
 #endif
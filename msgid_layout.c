@@ -0,0 +1,290 @@
+/** \file msgid_layout.c
+ * Layout of the message.id directory.
+ *
+ * Spools without a marker file use version 1: message.id/NNN/<mid>
+ * with NNN from msgid_hash(). Version 2 hashes the sanitized
+ * Message-ID with SipHash-2-4 under a key chosen per spool into a
+ * configurable number of buckets b, stored as
+ * message.id/<b % 1000>/<b / 1000>/<mid>, so that no directory level
+ * has more than 1000 entries besides the articles.
+ *
+ * The layout is recorded in $(SPOOLDIR)/leaf.node/spool.version:
+ *
+ *   layout 2 <buckets> <key in hex>
+ *   previous 1
+ *
+ * The "previous" line is present while texpire -H rehashes the spool;
+ * lookup() then falls back to the previous layout for articles that
+ * have not been moved yet, so readers need not be stopped. Long-running
+ * programs notice a new marker within a second.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+#include "arc4random.h"
+#include "format.h"
+#include "ln_log.h"
+#include "mastring.h"
+#include "msgid.h"
+#include "siphash.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+static struct msgid_layout cur = { 1, 1000, { 0 } };
+static struct msgid_layout prev;
+static int have_prev;
+static int unknown;		/* the marker names a layout we do not know */
+static time_t checked;		/* when we last looked at the marker */
+static struct stat marker;	/* the marker we parsed, st_ino 0 if none */
+
+/*@dependent@*/ static const char *
+markerfile(void)
+{
+    static mastr *name;
+
+    if (!name) {
+	name = mastr_new(LN_PATH_MAX);
+	(void)mastr_vcat(name, spooldir, "/leaf.node/spool.version", NULL);
+    }
+    return mastr_str(name);
+}
+
+static int
+hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    return -1;
+}
+
+/** parse "<version> [<buckets> <key>]" into \p l.
+ * \return 0 for success, -1 for a malformatted or unknown layout */
+static int
+parse_layout(const char *p, struct msgid_layout *l)
+{
+    char hex[33];
+    int i;
+
+    memset(l, 0, sizeof(*l));
+    if (sscanf(p, "%d", &l->version) != 1)
+	return -1;
+    if (l->version == 1) {
+	l->buckets = 1000;
+	return 0;
+    }
+    if (l->version != 2
+	    || sscanf(p, "%*d %lu %32s", &l->buckets, hex) != 2
+	    || l->buckets < 1 || l->buckets > MSGID_MAXBUCKETS
+	    || strlen(hex) != 32)
+	return -1;
+    for (i = 0; i < 16; i++) {
+	int hi = hexval(hex[2 * i]), lo = hexval(hex[2 * i + 1]);
+
+	if (hi < 0 || lo < 0)
+	    return -1;
+	l->key[i] = (unsigned char)(hi * 16 + lo);
+    }
+    return 0;
+}
+
+static void
+format_layout(FILE *f, const char *tag, const struct msgid_layout *l)
+{
+    int i;
+
+    fprintf(f, "%s %d", tag, l->version);
+    if (l->version == 2) {
+	fprintf(f, " %lu ", l->buckets);
+	for (i = 0; i < 16; i++)
+	    fprintf(f, "%02x", l->key[i]);
+    }
+    fputc('\n', f);
+}
+
+/** read the marker if it changed since we last parsed it */
+static void
+refresh(void)
+{
+    struct stat st;
+    FILE *f;
+    char *l;
+    time_t now = time(NULL);
+
+    if (checked == now)
+	return;
+    checked = now;
+    if (stat(markerfile(), &st)) {
+	if (errno != ENOENT)
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot stat %s: %m",
+		    markerfile());
+	else if (marker.st_ino) {
+	    /* marker removed, back to the legacy layout */
+	    memset(&marker, 0, sizeof(marker));
+	    cur.version = 1;
+	    cur.buckets = 1000;
+	    have_prev = 0;
+	    unknown = 0;
+	}
+	return;
+    }
+    if (st.st_ino == marker.st_ino && st.st_dev == marker.st_dev
+	    && st.st_mtime == marker.st_mtime && st.st_size == marker.st_size)
+	return;
+    if (!(f = fopen(markerfile(), "r"))) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot open %s: %m", markerfile());
+	return;
+    }
+    have_prev = 0;
+    unknown = 0;
+    while ((l = getaline(f))) {
+	if (!strncmp(l, "layout ", 7)) {
+	    if (parse_layout(l + 7, &cur)) {
+		/* guessing would make texpire remove every article
+		 * as wrongly hashed */
+		ln_log(LNLOG_SCRIT, LNLOG_CTOP,
+			"%s: unknown spool layout \"%s\"", markerfile(), l);
+		unknown = 1;
+	    }
+	} else if (!strncmp(l, "previous ", 9)) {
+	    have_prev = !parse_layout(l + 9, &prev);
+	}
+    }
+    (void)fclose(f);
+    marker = st;
+}
+
+/** \return the current layout, or with \p previous set, the layout
+ * being migrated from or NULL if no migration is in progress. Both are
+ * NULL if spool.version names a layout we do not know; the spool
+ * must not be touched then. */
+/*@observer@*/ /*@null@*/ const struct msgid_layout *
+msgid_layout(int previous)
+{
+    refresh();
+    if (unknown)
+	return NULL;
+    if (previous)
+	return have_prev ? &prev : NULL;
+    return &cur;
+}
+
+/** fill \p l with a version 2 layout of \p buckets and a new key */
+void
+msgid_layout_new(struct msgid_layout *l, unsigned long buckets)
+{
+    int i;
+
+    l->version = 2;
+    l->buckets = buckets;
+    for (i = 0; i < 16; i++)
+	l->key[i] = (unsigned char)arc4random();
+}
+
+/** record \p l as the layout, and \p previous as the one being
+ * migrated from, unless NULL.
+ * \return 0 for success, -1 for error */
+int
+msgid_layout_set(const struct msgid_layout *l,
+	/*@null@*/ const struct msgid_layout *previous)
+{
+    const char *name = markerfile();
+    mastr *tmp = mastr_new(LN_PATH_MAX);
+    struct stat st;
+    FILE *f = NULL;
+    int fd, rc = 0;
+
+    (void)mastr_vcat(tmp, name, ".XXXXXXXXXX", NULL);
+    if ((fd = safe_mkstemp(mastr_modifyable_str(tmp))) < 0
+	    || !(f = fdopen(fd, "w"))) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot create %s: %m",
+		mastr_str(tmp));
+	if (fd >= 0) {
+	    (void)close(fd);
+	    (void)unlink(mastr_str(tmp));
+	}
+	mastr_delete(tmp);
+	return -1;
+    }
+    (void)fchmod(fd, 0660);
+    fputs("# leafnode message.id layout, see texpire(8) -H\n", f);
+    format_layout(f, "layout", l);
+    if (previous)
+	format_layout(f, "previous", previous);
+    if (fflush(f) || ferror(f) || log_fsync(fd) || fstat(fd, &st)
+	    || rename(mastr_str(tmp), name) || sync_parent(name)) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot write %s: %m", name);
+	(void)unlink(mastr_str(tmp));
+	rc = -1;
+    }
+    (void)fclose(f);
+    mastr_delete(tmp);
+    if (rc == 0) {
+	cur = *l;
+	unknown = 0;
+	if ((have_prev = previous != NULL))
+	    prev = *previous;
+	marker = st;
+	checked = time(NULL);
+    }
+    return rc;
+}
+
+/** \return the number of leaf directories of layout \p l */
+unsigned long
+msgid_layout_dirs(const struct msgid_layout *l)
+{
+    return l->version == 1 ? 1000 : l->buckets;
+}
+
+/** set \p s to the path of leaf directory \p n of layout \p l */
+void
+msgid_layout_dir(mastr *s, const struct msgid_layout *l, unsigned long n)
+{
+    char num[8];
+
+    if (l->version == 1) {
+	str_ulong0(num, n, 3);
+    } else {
+	str_ulong0(num, n % 1000, 3);
+	num[3] = '/';
+	str_ulong0(num + 4, n / 1000, 3);
+    }
+    mastr_clear(s);
+    (void)mastr_vcat(s, spooldir, "/message.id/", num, NULL);
+}
+
+/** write the leaf directory for the sanitized Message-ID that is
+ * stored at \p p + MSGID_DIRLEN(\p l) to \p p, followed by a slash */
+void
+msgid_layout_path(char *p, const struct msgid_layout *l)
+{
+    const char *m = p + MSGID_DIRLEN(l);
+
+    if (l->version == 1) {
+	str_ulong0(p, msgid_hash(m), 3);
+	p[3] = '/';
+    } else {
+	unsigned long b = (unsigned long)(siphash24(l->key, m, strlen(m))
+		% l->buckets);
+
+	str_ulong0(p, b % 1000, 3);
+	p[3] = '/';
+	str_ulong0(p + 4, b / 1000, 3);
+	p[7] = '/';
+    }
+}
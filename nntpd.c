@@ -19,6 +19,11 @@
 #include "masock.h"
 #include "msgid.h"
 #include "mailto.h"
+#include "queueindex.h"
+#include "artstore.h"
+#include "hdrcache.h"
+#include "xpatindex.h"
+#include "threadidx.h"
 
 /* FIXME: write wrapper for this fellow */
 #ifdef SOCKS
@@ -28,6 +33,7 @@
 #include <pwd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 /* FIXME: is arpa/inet.h still needed after masock_* split? */
@@ -373,7 +379,7 @@ fopenart(/*@null@*/ const struct newsgroup *group, const char *arg, unsigned lon
 	if (is_pseudogroup(group->name)) {
 	    f = fopenpseudoart(group, arg, a);
 	} else {
-	    f = fopen(arg, "r");
+	    f = artstore_open(group->name, a);
 	}
 	if (!f && errno != ENOENT)
 	    ln_log(LNLOG_SERR, LNLOG_CARTICLE, "cannot open %s in %s: %m", arg, group->name);
@@ -388,15 +394,14 @@ fopenart(/*@null@*/ const struct newsgroup *group, const char *arg, unsigned lon
 	{
 	    f = fopenpseudoart(group, arg, 0);
 	} else {
-	    f = fopen(lookup(arg), "r");
+	    f = artstore_open_mid(arg);
 	}
 	if (!f && errno != ENOENT)
 	    ln_log(LNLOG_SERR, LNLOG_CARTICLE, "cannot open %s: %m", arg);
     } else if (group && *artno) {
 	char s[64];
-	(void)chdirgroup(group->name, FALSE);
 	sprintf(s, "%lu", *artno);
-	f = fopen(s, "r");
+	f = artstore_open(group->name, *artno);
 	if (!f && is_pseudogroup(group->name) && allowsubscribe())
 	    f = fopenpseudoart(group, s, *artno);
 	if (!f && errno != ENOENT)
@@ -542,6 +547,81 @@ allowposting(void)
     return 2 - allowpost;
 }
 
+/** size of the block that putwire() assembles before handing it to stdio */
+#define WIREBLOCK 65536
+
+/** Find the empty line that separates header and body in the spooled
+ * article \p p of \p len bytes. Only complete lines are considered, like
+ * getaline() does. \p hdrend receives the length of the header (up to
+ * but excluding the empty line), \p bodystart the offset of the body.
+ * \return 1 if the separator was found, 0 if the article has no body.
+ */
+static int
+wire_split(const char *p, size_t len, /*@out@*/ size_t *hdrend,
+	   /*@out@*/ size_t *bodystart)
+{
+    const char *s = p, *e = p + len, *nl, *t;
+
+    while (s < e && (nl = (const char *)memchr(s, '\n', (size_t)(e - s)))) {
+	for (t = s; t < nl && *t == '\r'; t++)
+	    ;
+	if (t == nl) {
+	    *hdrend = (size_t)(s - p);
+	    *bodystart = (size_t)(nl + 1 - p);
+	    return 1;
+	}
+	s = nl + 1;
+    }
+    *hdrend = (size_t)(s - p);
+    *bodystart = *hdrend;
+    return 0;
+}
+
+/** Send the LF-terminated spool text \p p of \p len bytes to stdout in
+ * NNTP wire format: line ends become CRLF and lines starting with a dot
+ * are dot-stuffed. The output is assembled in large blocks rather than
+ * going through getaline() and three stdio calls per line. A trailing
+ * incomplete line is dropped, as getaline() would.
+ */
+static void
+putwire(const char *p, size_t len)
+{
+    static char *buf;
+    size_t fill = 0, l;
+    const char *s = p, *e = p + len, *nl, *t;
+
+    if (!buf)
+	buf = (char *)critmalloc(WIREBLOCK, "putwire");
+
+    while (s < e && (nl = (const char *)memchr(s, '\n', (size_t)(e - s)))) {
+	for (t = nl; t > s && t[-1] == '\r'; t--)
+	    ;
+	l = (size_t)(t - s);
+	if (fill + l + 3 > WIREBLOCK) {
+	    (void)fwrite(buf, 1, fill, stdout);
+	    fill = 0;
+	    if (l + 3 > WIREBLOCK) {
+		/* overlong line, write it straight from the mapping */
+		if (*s == '.')
+		    putc('.', stdout);
+		(void)fwrite(s, 1, l, stdout);
+		fputs("\r\n", stdout);
+		s = nl + 1;
+		continue;
+	    }
+	}
+	if (*s == '.')
+	    buf[fill++] = '.';	/* escape . */
+	memcpy(buf + fill, s, l);
+	fill += l;
+	buf[fill++] = '\r';
+	buf[fill++] = '\n';
+	s = nl + 1;
+    }
+    if (fill)
+	(void)fwrite(buf, 1, fill, stdout);
+}
+
 /* display an article or somesuch */
 /* DOARTICLE */
 static void
@@ -554,6 +634,10 @@ doarticle(/*@null@*/ const struct newsgroup *group, const char *arg, int what,
     unsigned long localartno;
     char *localmsgid = NULL;
     char *l;
+    char *map = NULL;
+    size_t maplen = 0, hdrend = 0, bodystart = 0;
+    int nobody;
+    struct stat st;
     static const char *whatyouget[] = {
 	"request text separately",
 	"body follows",
@@ -588,13 +672,31 @@ doarticle(/*@null@*/ const struct newsgroup *group, const char *arg, int what,
     nntpprintf_as("%3d %lu %s article retrieved - %s", 223 - what,
 	    localartno, localmsgid, whatyouget[what]);
 
-    while ((l = getaline(f)) && *l) {
-	if (what & 2) {
-	    if (*l == '.')
-		putc('.', stdout);	/* escape . */
-	    fputs(l, stdout);
-	    fputs("\r\n", stdout);
+    /* map the article, spooled or pseudo, so we can send it in large
+     * blocks; empty and unmappable files take the line-by-line path */
+    if (what && !fstat(fileno(f), &st) && S_ISREG(st.st_mode)
+	    && st.st_size > 0) {
+	maplen = (size_t)st.st_size;
+	map = (char *)mmap(NULL, maplen, PROT_READ, MAP_PRIVATE,
+		fileno(f), 0);
+	if (map == (char *)MAP_FAILED)
+	    map = NULL;
+    }
+
+    if (map) {
+	nobody = !wire_split(map, maplen, &hdrend, &bodystart);
+	if (what & 2)
+	    putwire(map, hdrend);
+    } else {
+	while ((l = getaline(f)) && *l) {
+	    if (what & 2) {
+		if (*l == '.')
+		    putc('.', stdout);	/* escape . */
+		fputs(l, stdout);
+		fputs("\r\n", stdout);
+	    }
 	}
+	nobody = (l == NULL);
     }
 
     if (what == 3)
@@ -608,7 +710,7 @@ doarticle(/*@null@*/ const struct newsgroup *group, const char *arg, int what,
 	 * missing.
 	 */
 	/* EOF -> no body */
-	if (!l) {
+	if (nobody) {
 	    unsigned long markartno;
 	    char *markgroup;
 
@@ -635,6 +737,8 @@ doarticle(/*@null@*/ const struct newsgroup *group, const char *arg, int what,
 	    }
 	    if (markgroup)
 		free(markgroup);
+	} else if (map) {
+	    putwire(map + bodystart, maplen - bodystart);
 	} else {
 	    while ((l = getaline(f))) {
 		if (*l == '.')
@@ -648,6 +752,8 @@ doarticle(/*@null@*/ const struct newsgroup *group, const char *arg, int what,
     if (what)
 	fputs(".\r\n", stdout);
 
+    if (map)
+	(void)munmap(map, maplen);
     (void)fclose(f);
 
     free(localmsgid);
@@ -657,14 +763,17 @@ doarticle(/*@null@*/ const struct newsgroup *group, const char *arg, int what,
 static struct newsgroup *
 opengroup(struct newsgroup *g)
 {
-    freexover();
     xovergroup = NULL;
     /* If this group is interesting and requested, update the time stamp
        so it remains interesting even without articles */
     if (is_interesting(g->name))
 	markinterest(g->name);
-    if (chdirgroup(g->name, FALSE)) {
-	xgetxover(0, g, 0);
+    if (!chdirgroup(g->name, FALSE)) {
+	freexover();
+    } else {
+	/* only reads what changed if the group was selected before */
+	if (xmapxover(g))
+	    xovergroup = g;
 #if 0
 	if (g->count == 0) {
 	    if (getwatermarks(&g->first, &g->last, &g->count)) {
@@ -740,6 +849,7 @@ dohelp(void)
     printf("  xhdr header [range|MessageID]\r\n");
     printf("  xover [range]\r\n");
     printf("  xpat header range|MessageID pat [morepat...]\r\n");
+    printf("  xthread [range]\r\n");
 /*  printf("  xpath MessageID\r\n"); */
     printf(".\r\n");
 }
@@ -833,13 +943,16 @@ list(struct newsgroup *g, int what, char *pattern)
 	}
     } else {
 	/* have a pattern */
+	struct wildpat *w = pattern ? wildpat_compile(pattern) : NULL;
+
 	ng = g;
 	while (ng->name) {
-	    if (!pattern || !ngmatch(pattern, ng->name)) {
+	    if (!w || wildpat_match(w, ng->name, strlen(ng->name))) {
 		printlist(ng, what);
 	    }
 	    ng++;
 	}
+	wildpat_free(w);
     }
 }
 
@@ -850,18 +963,24 @@ dolist(char *oarg)
 
     if (!strcasecmp(arg, "extensions")) {
 	nntpprintf_as("202 extensions supported follow");
-	fputs("HDR\r\n" "OVER\r\n" "XPAT\r\n" "LISTGROUP\r\n", stdout);
+	fputs("HDR\r\n" "OVER\r\n" "XPAT\r\n" "LISTGROUP\r\n"
+		"XTHREAD\r\n", stdout);
 	if (authentication)
 	    fputs(" AUTHINFO USER\r\n", stdout);
 	fputs(".\r\n", stdout);
     } else if (!strcasecmp(arg, "overview.fmt")) {
+	int i;
+
 	nntpprintf_as("215 information follows");
 	fputs("Subject:\r\n"
 	       "From:\r\n"
 	       "Date:\r\n"
 	       "Message-ID:\r\n"
 	       "References:\r\n"
-	       "Bytes:\r\n" "Lines:\r\n" "Xref:full\r\n" ".\r\n", stdout);
+	       "Bytes:\r\n" "Lines:\r\n" "Xref:full\r\n", stdout);
+	for (i = 0; i < xoverextras; i++)
+	    printf("%s:full\r\n", xoverextra_name(i));
+	fputs(".\r\n", stdout);
     } else if (!strcasecmp(arg, "active.times")) {
 #if 1
 	fputs("500 not implemented\r\n", stdout);
@@ -1002,6 +1121,7 @@ donewnews(char *arg)
     time_t age;
     DIR *d, *ng;
     struct dirent *de, *nga;
+    struct wildpat *w;
     mastr *s;
 
     if (!l) {
@@ -1029,10 +1149,11 @@ donewnews(char *arg)
     }
     if (!strpbrk(l->head->string, "\\*?[")) 
 	markinterest(l->head->string);
+    w = wildpat_compile(l->head->string);
     while ((de = readdir(d))) {
-	if (ngmatch(l->head->string, de->d_name) == 0) {
+	if (wildpat_match(w, de->d_name, strlen(de->d_name))) {
 	    chdirgroup(de->d_name, FALSE);
-	    xgetxover(1, NULL, 0);
+	    xmapxover(NULL);
 	    ng = opendir(".");
 	    while ((nga = readdir(ng))) {
 		unsigned long artno;
@@ -1044,11 +1165,12 @@ donewnews(char *arg)
 			long xo = findxover(artno);
 
 			if (xo >= 0) {
-			    char *x = getxoverfield(xoverinfo[xo].text, XO_MESSAGEID);
+			    size_t len;
+			    const char *x = xoverfield((unsigned long)xo,
+				    XO_MESSAGEID, &len);
 			    if (x) {
-				fputs(x, stdout);
+				fwrite(x, 1, len, stdout);
 				fputs("\r\n", stdout);
-				free(x);
 			    } else {
 				/* FIXME: cannot find message ID in XOVER */
 				ln_log(LNLOG_SERR, LNLOG_CTOP,
@@ -1069,6 +1191,7 @@ donewnews(char *arg)
     }
     xovergroup = NULL;
     closedir(d);
+    wildpat_free(w);
     freelist(l);
     mastr_delete(s);
     fputs(".\r\n", stdout);
@@ -1498,8 +1621,9 @@ dopost(void)
 		break;
 	    default:
 		nntpprintf("441 Server error: cannot allocate Message-ID.");
-		ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot link %s to %s: %m",
-			inname, lookup(mid));
+		ln_log(LNLOG_SERR, LNLOG_CTOP,
+			"cannot link %s into message.id as %s: %m",
+			inname, mid);
 		log_unlink(inname, 0);
 		goto cleanup;
 	}
@@ -1581,6 +1705,7 @@ dopost(void)
 			   "to upstream, see syslog.");
 		goto unlink_cleanup;
 	    }
+	    queueindex_add("out.going", outbasename, mid);
 	}
 
 	if (!(modgroup && !approved) && /* don't store unapproved moderated posts */
@@ -1595,14 +1720,19 @@ dopost(void)
 		/* error with spooling locally -> also drop from out.going (to avoid
 		 * that the user resends the article after the 503 code)
 		 */
-		if (!is_alllocal(groups))
-			log_unlink(mastr_str(outgoingname), 0);
+		if (!is_alllocal(groups)
+			&& 0 == log_unlink(mastr_str(outgoingname), 0))
+			queueindex_remove("out.going", outbasename);
 		goto unlink_cleanup;
 	    }
+	    queueindex_add("in.coming", outbasename, mid);
 	} else {
 	    /* remove message.id link so fetchnews can download the
 	     * posting */
-	    log_unlink(lookup(mid), 0);
+	    const char *m = lookup(mid);
+
+	    if (m)
+		log_unlink(m, 0);
 	}
 	log_unlink(inname, 0);
 
@@ -1726,6 +1856,7 @@ doselectedheader(/*@null@*/ const struct newsgroup *group /** current newsgroup
     unsigned long a, b = 0;
     long int i, idxa, idxb;
     char *header;
+    struct wildpat *w;
 
     header = (char *)critmalloc((i = strlen(hd)) + 2, "doselectedheader");
     strcpy(header, hd);
@@ -1781,12 +1912,14 @@ doselectedheader(/*@null@*/ const struct newsgroup *group /** current newsgroup
 	/* FIXME: does this work for local groups? */
 	/* is a real group */
 	if (xovergroup != group) {
-	    if (xgetxover(1, NULL, 0))
+	    if (xmapxover(NULL))
 		xovergroup = group;
 	}
     } else {
 	/* is a pseudo group */
 
+	if (OVfield >= XO_EXTRA)
+	    OVfield = XO_ERR;	/* overview_headers, see default below */
 	if (patterns) {		/* placeholder matches pseudogroup never */
 	    nntpprintf_as("221 %s header matches follow:", hd);
 	    fputs(".\r\n", stdout);
@@ -1862,26 +1995,68 @@ doselectedheader(/*@null@*/ const struct newsgroup *group /** current newsgroup
 	free(header);
 	return;
     }
+    /* compile the patterns once for the whole range */
+    w = patterns ? wildpat_compilelist(patterns) : NULL;
     if (OVfield != XO_ERR) {
+	const unsigned long *cand = NULL;
+	unsigned long ncand = 0, k = 0;
+
 	nntpprintf_as("221 %s header %s(from overview) for postings %lu-%lu:",
 		   hd, patterns ? "matches " : "", a, b);
 
+	/* the trigram index may know the few entries worth matching */
+	if (w && !xpatindex_find(OVfield, w, (unsigned long)idxa,
+		    (unsigned long)idxb, &cand, &ncand))
+	    cand = NULL;
 	for (i = idxa; i <= idxb; i++) {
-	    char *t;
-	    l = getxoverfield(xoverinfo[i].text, OVfield);
-	    if (!l)
+	    size_t len;
+	    const char *t;
+
+	    if (cand) {
+		if (k == ncand)
+		    break;
+		i = (long)cand[k++];
+	    }
+	    l = NULL;
+	    switch (xoverheader(i, OVfield, &t, &len)) {
+	    case 0:
 		continue;
-	    t = (OVfield == XO_XREF ? l+6 : l); /* cut out 'Xref: ' if necessary */
+	    case -1:
+		/* overview line from before overview_headers listed
+		 * this header, ask the article */
+		{
+		    char s[64];
+
+		    sprintf(s, "%lu", xoverartno(i));
+		    if (!(l = getheader(s, header)))
+			continue;
+		    STRIP_TRAILING_SPACE(l);
+		    if (!*l) {
+			free(l);
+			continue;
+		    }
+		    t = l;
+		    len = strlen(l);
+		}
+		break;
+	    }
 
-	    if (patterns && !matchlist(patterns, t)) {
-		free(l);
+	    if (patterns && !wildpat_match(w, t, len)) {
+		if (l)
+		    free(l);
 		continue;
 	    }
 
-	    printf("%lu %s\r\n", xoverinfo[i].artno, t);
-	    free(l);
+	    printf("%lu ", xoverartno(i));
+	    fwrite(t, 1, len, stdout);
+	    fputs("\r\n", stdout);
+	    if (l)
+		free(l);
 	}
     } else {
+	/* values read before are kept in the group's header cache */
+	int cached = hdrcache_open(header);
+
 	nntpprintf
 	    ("221 %s header %s(from article files) for postings %lu-%lu:",
 	     hd, patterns ? "matches " : "", a, b);
@@ -1890,24 +2065,35 @@ doselectedheader(/*@null@*/ const struct newsgroup *group /** current newsgroup
 	   saves trying to open non-existing articles */
 	for (i = idxa; i <= idxb; i++) {
 	    char s[64];
-	    unsigned long c = xoverinfo[i].artno;
+	    unsigned long c = xoverartno(i);
+	    const char *v;
 
-	    sprintf(s, "%lu", c);
-	    l = getheader(s, header);
-	    if (!l)
+	    l = NULL;
+	    switch (cached ? hdrcache_get(c, &v) : -1) {
+	    case 0:
 		continue;
+	    case -1:
+		sprintf(s, "%lu", c);
+		l = getheader(s, header);
+		STRIP_TRAILING_SPACE(l);
+		if (cached)
+		    hdrcache_put(c, l);
+		if (!l)
+		    continue;
+		v = l;
+		break;
+	    }
 
-	    STRIP_TRAILING_SPACE(l);
-	    if (patterns && !matchlist(patterns, l)) {
+	    if ((!patterns || wildpat_match(w, v, strlen(v))) && *v)
+		printf("%lu %s\r\n", c, v);
+	    if (l)
 		free(l);
-		continue;
-	    }
-	    if (*l)
-		printf("%lu %s\r\n", c, l);
-	    free(l);
 	}
+	if (cached)
+	    hdrcache_close();
     }
     fputs(".\r\n", stdout);
+    wildpat_free(w);
     free(header);
     return;
 }static void
@@ -1985,8 +2171,7 @@ doxover(/*@null@*/ const struct newsgroup *group, const char *arg, unsigned long
 
     if (!is_pseudogroup(group->name)) {
 	if (xovergroup != group) {
-	    freexover();
-	    if (xgetxover(1, NULL, 0))
+	    if (xmapxover(NULL))
 		xovergroup = group;
 	    else
 		xovergroup = NULL;
@@ -2002,8 +2187,11 @@ doxover(/*@null@*/ const struct newsgroup *group, const char *arg, unsigned long
 		("224 Overview information for postings %lu-%lu:",
 		 a, b);
 	    for (idx = idxa; idx <= idxb; idx++) {
-		if (xoverinfo[idx].text != NULL) {
-		    fputs(xoverinfo[idx].text, stdout);
+		size_t len;
+		const char *x = xoverline((unsigned long)idx, &len);
+
+		if (x != NULL) {
+		    fwrite(x, 1, len, stdout);
 		    fputs("\r\n", stdout);
 		}
 	    }
@@ -2031,6 +2219,61 @@ doxover(/*@null@*/ const struct newsgroup *group, const char *arg, unsigned long
     }
 }
 
+/* XTHREAD [range]: one line "artno thread parent" per article, where
+ * thread is the lowest article number of the article's thread and
+ * parent the article it follows up to, 0 if that is not in the group */
+static void
+doxthread(/*@null@*/ const struct newsgroup *group, const char *arg, unsigned long artno)
+{
+    unsigned long a, b, thread, mid, parent;
+    long int idx, idxa, idxb;
+
+    if (!group) {
+	nntpprintf("412 Use the GROUP command first");
+	return;
+    }
+
+    if (!*arg)
+	arg = 0;
+
+    if (arg && (parserange(arg, &a, &b) & RANGE_ERR)) {
+	nntpprintf("502 Usage: XTHREAD [first[-[last]]]");
+	return;
+    }
+
+    if (is_pseudogroup(group->name)) {
+	nntpprintf("420 No articles in specified range.");
+	return;
+    }
+
+    if (xovergroup != group) {
+	if (xmapxover(NULL))
+	    xovergroup = group;
+	else
+	    xovergroup = NULL;
+    }
+
+    if (!dorange(arg, &a, &b, artno, xfirst, xlast))
+	return;
+
+    if (findxoverrange(a, b, &idxa, &idxb) == -1) {
+	nntpprintf("420 No articles in specified range.");
+	return;
+    }
+    if (!threadidx_open(THREADIDX_UPDATE)) {
+	nntpprintf("503 Thread index not available.");
+	return;
+    }
+    nntpprintf("224 Thread information for postings %lu-%lu:", a, b);
+    for (idx = idxa; idx <= idxb; idx++) {
+	unsigned long n = xoverartno((unsigned long)idx);
+
+	if (threadidx_get(n, &thread, &mid, &parent))
+	    printf("%lu %lu %lu\r\n", n, thread, parent);
+    }
+    fputs(".\r\n", stdout);
+}
+
 static int strnum_comp(const void *p1, const void *p2) {
     char *const *s1 = (char * const*) p1;
     char *const *s2 = (char * const*) p2;
@@ -2070,7 +2313,7 @@ dolistgroup(/*@null@*/ struct newsgroup *group, const char *arg, unsigned long *
 	markinterest(group->name);
     } else if ((xovergroup != group)
 	    && chdirgroup(group->name, FALSE)
-	    && !xgetxover(1, NULL, 0)) {
+	    && !xmapxover(NULL)) {
 	if (is_interesting(g->name)) {
 	    /* group has already been marked as interesting but is empty */
 	    emptygroup = TRUE;
@@ -2489,6 +2732,9 @@ main_loop(void)
 	} else if (!strcasecmp(cmd, "xover") || !strcasecmp(cmd, "over")) {
 	    if (isauthorized())
 		doxover(group, arg, artno);
+	} else if (!strcasecmp(cmd, "xthread")) {
+	    if (isauthorized())
+		doxthread(group, arg, artno);
 	} else if (!strcasecmp(cmd, "listgroup")) {
 	    if (isauthorized())
 		group = dolistgroup(group, arg, &artno);
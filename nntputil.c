@@ -30,6 +30,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -44,6 +46,7 @@ long sendbuf;
 char last_command[1025];
 /*@dependent@*/ FILE *nntpin  = NULL;
 /*@dependent@*/ FILE *nntpout = NULL;
+static pid_t receiver = -1;	/* receive process, see start_receiver */
 
 /**
  * Authenticate ourselves at a remote server.
@@ -295,6 +298,119 @@ tcp_connect(/** host name or address in dotted or colon (IPv6)
     return sock;
 }
 
+/** Body of the receive process: copy everything from socket \p sock to
+ * pipe \p out, buffering up to receive_queue bytes in memory, until
+ * the server closes the connection or our reader goes away. */
+static void receive_loop(int sock, int out)
+    __attribute__ ((noreturn));
+/*@noreturn@*/ static void
+receive_loop(int sock, int out)
+{
+    char *buf = (char *)malloc((size_t)receive_queue);
+    size_t head = 0, fill = 0, size = (size_t)receive_queue;
+    int eof = 0;
+    struct pollfd pfd[2];
+    ssize_t r;
+
+    if (!buf)
+	_exit(EXIT_FAILURE);
+    (void)fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    (void)fcntl(out, F_SETFL, fcntl(out, F_GETFL) | O_NONBLOCK);
+
+    while (!eof || fill) {
+	pfd[0].fd = (!eof && fill < size) ? sock : -1;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = out;	/* also tells us when the reader is gone */
+	pfd[1].events = fill ? POLLOUT : 0;
+	pfd[0].revents = pfd[1].revents = 0;
+	if (poll(pfd, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if (pfd[0].revents) {
+	    /* fill the contiguous free space of the ring */
+	    size_t tail = (head + fill) % size;
+	    size_t room = (tail >= head) ? size - tail : head - tail;
+
+	    r = read(sock, buf + tail, room);
+	    if (r > 0)
+		fill += r;
+	    else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+		eof = 1;
+	}
+	if (pfd[1].revents & (POLLERR | POLLHUP | POLLNVAL))
+	    break;		/* reader is gone */
+	if (pfd[1].revents & POLLOUT) {
+	    size_t len = (head + fill > size) ? size - head : fill;
+
+	    r = write(out, buf + head, len);
+	    if (r > 0) {
+		head = (head + r) % size;
+		fill -= r;
+	    } else if (r < 0 && errno != EAGAIN && errno != EINTR) {
+		break;		/* reader is gone */
+	    }
+	}
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/** Start a process that drains the server's replies from socket \p
+ * sock into memory while we are busy storing articles, so that the
+ * server can keep sending. \return descriptor to read the replies
+ * from, or -1 to read the socket directly. */
+static int
+start_receiver(int sock)
+{
+    int p[2];
+
+    if (receive_queue <= 0)
+	return -1;
+    if (pipe(p)) {
+	ln_log(LNLOG_SERR, LNLOG_CSERVER, "cannot create pipe: %m");
+	return -1;
+    }
+    switch (receiver = fork()) {
+    case -1:
+	ln_log(LNLOG_SERR, LNLOG_CSERVER, "cannot fork receive process: %m");
+	(void)close(p[0]);
+	(void)close(p[1]);
+	return -1;
+    case 0:
+	/* the caller's handlers may longjmp back into its main loop */
+	(void)signal(SIGPIPE, SIG_IGN);
+	(void)signal(SIGINT, SIG_IGN);
+	(void)signal(SIGALRM, SIG_DFL);
+	(void)signal(SIGTERM, SIG_DFL);
+	(void)signal(SIGUSR1, SIG_DFL);
+	(void)signal(SIGUSR2, SIG_DFL);
+	(void)close(p[0]);
+	receive_loop(sock, p[1]);
+	/*NOTREACHED*/
+    default:
+	(void)close(p[1]);
+	/* other children must not keep the receiver alive */
+	(void)fcntl(p[0], F_SETFD, FD_CLOEXEC);
+	if (debugmode & DEBUG_NNTP)
+	    ln_log(LNLOG_SDEBUG, LNLOG_CSERVER,
+		    "receive process %ld started, queue %ld bytes",
+		    (long)receiver, receive_queue);
+	return p[0];
+    }
+}
+
+/** Wait for the receive process to exit. The caller must have closed
+ * the reading end of the pipe; receive_loop() sees that and exits. */
+static void
+stop_receiver(void)
+{
+    if (receiver > 0) {
+	(void)waitpid(receiver, NULL, 0);
+	receiver = -1;
+    }
+}
+
 /**
  * Connect to upstream NNTP server.
  *
@@ -323,7 +439,9 @@ nntpconnect(const struct serverlist *upstream)
     if (sock < 0)
 	return 0;
 
-    infd = dup(sock);
+    infd = start_receiver(sock);
+    if (infd < 0)
+	infd = dup(sock);
     if (infd < 0) {
 	ln_log(LNLOG_SERR, LNLOG_CSERVER, "cannot dup(%d): %m", sock);
 	(void)close(sock);
@@ -334,6 +452,8 @@ nntpconnect(const struct serverlist *upstream)
     if (nntpout == NULL) {
 	ln_log(LNLOG_SERR, LNLOG_CSERVER, "cannot fdopen(%d): %m", sock);
 	(void)close(sock);
+	(void)close(infd);
+	stop_receiver();
 	return 0;
     }
 
@@ -342,6 +462,8 @@ nntpconnect(const struct serverlist *upstream)
 	ln_log(LNLOG_SERR, LNLOG_CSERVER, "cannot fdopen(%d): %m", infd);
 	(void)fclose(nntpout);
 	(void)close(sock);
+	(void)close(infd);
+	stop_receiver();
 	return 0;
     }
 
@@ -420,4 +542,5 @@ nntpdisconnect()
 	fclose(nntpout);
 	nntpout = NULL;
     }
+    stop_receiver();
 }
@@ -0,0 +1,485 @@
+/** \file queueindex.c
+ * Message-ID index of the out.going and in.coming queues.
+ *
+ * Cancels and Supersedes: must remove queued postings with the
+ * cancelled Message-ID. Rather than opening every queued file and
+ * reading its Message-ID: header, we keep an append-only log per queue
+ * directory in $(SPOOLDIR)/leaf.node/<dir>.msgids with one record per
+ * line:
+ *
+ *   +<file>\t<Message-ID>   file was queued
+ *   -<file>                 file was removed from the queue
+ *
+ * The log is replayed into two red-black trees (by file name and by
+ * Message-ID) and only the new tail is read on later lookups. Programs
+ * that queue or dequeue files without telling us are detected because
+ * the queue directory then is not older than the log; the index is
+ * then reconciled with a directory listing, which only opens files
+ * we have not seen before. The index is only a hint, callers
+ * must verify the Message-ID of the files it returns.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+#include "critmem.h"
+#include "ln_log.h"
+#include "mastring.h"
+#include "redblack.h"
+#include "queueindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+/** rewrite the log when it carries this many stale records more than
+ * live ones */
+#define QI_SLACK 256
+
+struct qientry {
+    const char *name;		/* file name within the queue directory */
+    const char *mid;		/* its Message-ID */
+};
+
+static struct qindex {
+    struct qindex *next;
+    char *dir;			/* queue directory, relative to spooldir */
+    struct rbtree *byname;	/* qientry by name */
+    struct rbtree *bymid;	/* qientry by Message-ID, then name */
+    dev_t dev;			/* identity of the log we replayed */
+    ino_t ino;
+    off_t offset;		/* how far we replayed it */
+    unsigned long live, dead;
+} *indices;
+
+static int
+cmp_name(const void *a, const void *b,
+	/*@unused@*/ const void *config __attribute__ ((unused)))
+{
+    return strcmp(((const struct qientry *)a)->name,
+	    ((const struct qientry *)b)->name);
+}
+
+static int
+cmp_mid(const void *a, const void *b,
+	/*@unused@*/ const void *config __attribute__ ((unused)))
+{
+    const struct qientry *x = (const struct qientry *)a;
+    const struct qientry *y = (const struct qientry *)b;
+    int r = strcmp(x->mid, y->mid);
+
+    return r ? r : strcmp(x->name, y->name);
+}
+
+/** \return non-zero if \p a was modified after \p b. Time stamps
+ * are coarser than their nanosecond fields suggest, so equal time
+ * stamps do not prove anything. */
+static int
+newer(const struct stat *a, const struct stat *b)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+	return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+    return a->st_mtim.tv_nsec > b->st_mtim.tv_nsec;
+#else
+    return a->st_mtime > b->st_mtime;
+#endif
+}
+
+static void
+logname(mastr *s, const char *dir)
+{
+    mastr_clear(s);
+    (void)mastr_vcat(s, spooldir, "/leaf.node/", dir, ".msgids", NULL);
+}
+
+static /*@observer@*/ const char *
+basename_of(const char *file)
+{
+    const char *p = strrchr(file, '/');
+
+    return p ? p + 1 : file;
+}
+
+static void
+entry_drop(struct qindex *q, const char *name)
+{
+    struct qientry key;
+    const void *e;
+
+    key.name = name;
+    e = rbfind(&key, q->byname);
+    if (e) {
+	(void)rbdelete(e, q->byname);
+	(void)rbdelete(e, q->bymid);
+	/* this is ugly, but rbfind delivers const */
+	free((void *)e);
+	q->live--;
+	q->dead++;
+    }
+}
+
+static void
+entry_add(struct qindex *q, const char *name, const char *mid)
+{
+    static const char myname[] = "queueindex";
+    size_t nl = strlen(name) + 1, ml = strlen(mid) + 1;
+    struct qientry *e;
+    char *p;
+
+    entry_drop(q, name);
+    e = (struct qientry *)critmalloc(sizeof(*e) + nl + ml, myname);
+    p = (char *)(e + 1);
+    memcpy(p, name, nl);
+    memcpy(p + nl, mid, ml);
+    e->name = p;
+    e->mid = p + nl;
+    if (!rbsearch(e, q->byname) || !rbsearch(e, q->bymid)) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "out of memory in %s", myname);
+	exit(EXIT_FAILURE);
+    }
+    q->live++;
+}
+
+static void
+index_clear(struct qindex *q)
+{
+    RBLIST *r;
+    const void *e;
+
+    if (q->byname) {
+	if ((r = rbopenlist(q->byname))) {
+	    while ((e = rbreadlist(r))) {
+		/* this is ugly, but rbreadlist delivers const */
+		free((void *)e);
+	    }
+	    rbcloselist(r);
+	}
+	rbdestroy(q->byname);
+    }
+    if (q->bymid)
+	rbdestroy(q->bymid);
+    q->byname = rbinit(cmp_name, NULL);
+    q->bymid = rbinit(cmp_mid, NULL);
+    if (!q->byname || !q->bymid) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "out of memory in queueindex");
+	exit(EXIT_FAILURE);
+    }
+    q->offset = 0;
+    q->live = q->dead = 0;
+}
+
+/** Replay log records from \p f, starting at q->offset. A trailing
+ * incomplete record (someone is appending) is left for the next run. */
+static void
+replay(struct qindex *q, FILE *f)
+{
+    char *l, *t;
+
+    if (fseeko(f, q->offset, SEEK_SET))
+	return;
+    while ((l = getaline(f))) {
+	if (*l == '+' && (t = strchr(l, '\t'))) {
+	    *t++ = '\0';
+	    entry_add(q, l + 1, t);
+	} else if (*l == '-') {
+	    entry_drop(q, l + 1);
+	}
+	q->offset = ftello(f);
+    }
+}
+
+static void
+append(const char *dir, const char *rec)
+{
+    mastr *lname = mastr_new(LN_PATH_MAX);
+    int fd;
+
+    logname(lname, dir);
+    /* a single write() to an O_APPEND file does not interleave with
+     * other writers */
+    fd = open(mastr_str(lname), O_WRONLY|O_APPEND);
+    if (fd < 0) {
+	/* no log yet - the next lookup will build it from the directory */
+	if (errno != ENOENT)
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot open %s: %m",
+		    mastr_str(lname));
+    } else {
+	if (writes(fd, rec) < 0)
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot write to %s: %m",
+		    mastr_str(lname));
+	(void)close(fd);
+    }
+    mastr_delete(lname);
+}
+
+/** Replace the log with the live entries of \p q.
+ * \return 0 for success, -1 for error */
+static int
+writelog(struct qindex *q, const mastr *lname)
+{
+    mastr *tmp = mastr_new(LN_PATH_MAX);
+    FILE *f = NULL;
+    RBLIST *r;
+    const struct qientry *e;
+    struct stat st;
+    int fd;
+
+    (void)mastr_vcat(tmp, mastr_str(lname), ".XXXXXXXXXX", NULL);
+    if ((fd = safe_mkstemp(mastr_modifyable_str(tmp))) < 0
+	    || !(f = fdopen(fd, "w"))) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot create %s: %m",
+		mastr_str(tmp));
+	if (fd >= 0) {
+	    (void)close(fd);
+	    (void)unlink(mastr_str(tmp));
+	}
+	mastr_delete(tmp);
+	return -1;
+    }
+    (void)fchmod(fd, 0660);
+    if ((r = rbopenlist(q->byname))) {
+	while ((e = (const struct qientry *)rbreadlist(r)))
+	    fprintf(f, "+%s\t%s\n", e->name, e->mid);
+	rbcloselist(r);
+    }
+    if (fflush(f) || ferror(f) || fstat(fd, &st)
+	    || rename(mastr_str(tmp), mastr_str(lname))) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot write %s: %m",
+		mastr_str(lname));
+	(void)fclose(f);
+	(void)unlink(mastr_str(tmp));
+	mastr_delete(tmp);
+	return -1;
+    }
+    (void)fclose(f);
+    q->dev = st.st_dev;
+    q->ino = st.st_ino;
+    q->offset = st.st_size;
+    q->dead = 0;
+    mastr_delete(tmp);
+    return 0;
+}
+
+static int
+cmp_str(const void *a, const void *b,
+	/*@unused@*/ const void *config __attribute__ ((unused)))
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+/** Compare the index with the file names in the queue directory. This
+ * reads the directory, but only opens the files we do not know yet.
+ * Changes are appended to the log, or the log is rewritten if \p
+ * rewrite is set or it carries too many stale records.
+ * \return 0 for success, -1 for error */
+static int
+reconcile(struct qindex *q, const mastr *lname, int rewrite)
+{
+    static const char myname[] = "queueindex";
+    char **dl, **t;
+    const char **gone;
+    size_t ngone = 0, i;
+    struct rbtree *names;
+    struct qientry key;
+    const struct qientry *e;
+    RBLIST *r;
+    mastr *rec;
+
+    if (!(dl = spooldirlist_prefix(q->dir, DIRLIST_NONDOT, NULL))) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot read directory %s/%s: %m",
+		spooldir, q->dir);
+	return -1;
+    }
+    if (!(names = rbinit(cmp_str, NULL))) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "out of memory in %s", myname);
+	exit(EXIT_FAILURE);
+    }
+    rec = mastr_new(LN_PATH_MAX);
+
+    /* files we have not heard of */
+    for (t = dl; *t; t++) {
+	key.name = basename_of(*t);
+	if (!rbsearch(key.name, names)) {
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "out of memory in %s", myname);
+	    exit(EXIT_FAILURE);
+	}
+	if (!rbfind(&key, q->byname)) {
+	    char *x = getheader(*t, "Message-ID:");
+	    if (x) {
+		entry_add(q, key.name, x);
+		(void)mastr_vcat(rec, "+", key.name, "\t", x, "\n", NULL);
+		free(x);
+	    }
+	}
+    }
+
+    /* files that went away behind our back */
+    gone = (const char **)critmalloc((q->live + 1) * sizeof(*gone), myname);
+    if ((r = rbopenlist(q->byname))) {
+	while ((e = (const struct qientry *)rbreadlist(r)))
+	    if (!rbfind(e->name, names))
+		gone[ngone++] = e->name;
+	rbcloselist(r);
+    }
+    for (i = 0; i < ngone; i++) {
+	(void)mastr_vcat(rec, "-", gone[i], "\n", NULL);
+	entry_drop(q, gone[i]);	/* frees gone[i] */
+    }
+    free(gone);
+    rbdestroy(names);
+    free_dirlist(dl);
+
+    if (rewrite || q->dead > q->live + QI_SLACK) {
+	if (writelog(q, lname)) {
+	    mastr_delete(rec);
+	    return -1;
+	}
+    } else if (mastr_len(rec)) {
+	append(q->dir, mastr_str(rec));
+    }
+    /* we are in sync with the directory now, say so */
+    (void)utimensat(AT_FDCWD, mastr_str(lname), NULL, 0);
+    mastr_delete(rec);
+    return 0;
+}
+
+/** Bring the in-core index for \p dir up to date.
+ * \return index or NULL if it is unusable */
+static /*@null@*/ /*@dependent@*/ struct qindex *
+index_get(const char *dir)
+{
+    struct qindex *q;
+    struct stat dst, lst;
+    mastr *lname, *dname;
+    FILE *f;
+    int ok = 0;
+
+    for (q = indices; q; q = q->next)
+	if (!strcmp(q->dir, dir))
+	    break;
+    if (!q) {
+	q = (struct qindex *)critcalloc(sizeof(*q), "queueindex");
+	q->dir = critstrdup(dir, "queueindex");
+	index_clear(q);
+	q->next = indices;
+	indices = q;
+    }
+
+    lname = mastr_new(LN_PATH_MAX);
+    dname = mastr_new(LN_PATH_MAX);
+    logname(lname, dir);
+    (void)mastr_vcat(dname, spooldir, "/", dir, NULL);
+
+    if (stat(mastr_str(dname), &dst)) {
+	ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot stat %s: %m", mastr_str(dname));
+	goto out;
+    }
+    if (stat(mastr_str(lname), &lst)) {
+	/* no log yet, build it from scratch */
+	index_clear(q);
+	ok = !reconcile(q, lname, 1);
+	goto out;
+    }
+    if (lst.st_dev != q->dev || lst.st_ino != q->ino
+	    || lst.st_size < q->offset) {
+	/* log was replaced by someone else, start over */
+	index_clear(q);
+	q->dev = lst.st_dev;
+	q->ino = lst.st_ino;
+    }
+    if (lst.st_size > q->offset) {
+	if (!(f = fopen(mastr_str(lname), "r"))) {
+	    ln_log(LNLOG_SERR, LNLOG_CTOP, "cannot open %s: %m",
+		    mastr_str(lname));
+	    q->dev = q->ino = 0;
+	    goto out;
+	}
+	replay(q, f);
+	(void)fclose(f);
+    }
+    /* if the directory changed after the last log update, someone may
+     * have queued or removed files without telling us */
+    if (!newer(&lst, &dst) || q->dead > q->live + QI_SLACK)
+	ok = !reconcile(q, lname, 0);
+    else
+	ok = 1;
+
+out:
+    mastr_delete(dname);
+    mastr_delete(lname);
+    return ok ? q : NULL;
+}
+
+/** Record that \p file (path or file name) was queued into \p dir
+ * (relative to spooldir) with Message-ID \p msgid. */
+void
+queueindex_add(const char *dir, const char *file, const char *msgid)
+{
+    mastr *rec = mastr_new(LN_PATH_MAX);
+
+    (void)mastr_vcat(rec, "+", basename_of(file), "\t", msgid, "\n", NULL);
+    append(dir, mastr_str(rec));
+    mastr_delete(rec);
+}
+
+/** Record that \p file (path or file name) was removed from \p dir. */
+void
+queueindex_remove(const char *dir, const char *file)
+{
+    mastr *rec = mastr_new(LN_PATH_MAX);
+
+    (void)mastr_vcat(rec, "-", basename_of(file), "\n", NULL);
+    append(dir, mastr_str(rec));
+    mastr_delete(rec);
+}
+
+/** Find the files in queue directory \p dir that carry Message-ID
+ * \p msgid. The result is a hint only, the caller must check the
+ * Message-ID: header of the files before acting on them.
+ * \return list of full path names like spooldirlist_prefix() returns,
+ * to be freed with free_dirlist(), or NULL if the index is unusable
+ * and the caller must scan the directory itself.
+ */
+/*@null@*/ /*@only@*/ char **
+queueindex_find(const char *dir, const char *msgid)
+{
+    struct qindex *q = index_get(dir);
+    struct qientry key;
+    const struct qientry *e;
+    char **dl;
+    size_t n = 0, size = 4;
+
+    if (!q)
+	return NULL;
+
+    dl = (char **)critmalloc(size * sizeof(*dl), "queueindex_find");
+    key.mid = msgid;
+    key.name = "";
+    for (e = (const struct qientry *)rblookup(RB_LUGTEQ, &key, q->bymid);
+	    e && !strcmp(e->mid, msgid);
+	    e = (const struct qientry *)rblookup(RB_LUGREAT, e, q->bymid)) {
+	mastr *p = mastr_new(LN_PATH_MAX);
+
+	if (n + 1 >= size) {
+	    size += size;
+	    dl = (char **)critrealloc((char *)dl, size * sizeof(*dl),
+		    "queueindex_find");
+	}
+	(void)mastr_vcat(p, spooldir, "/", dir, "/", e->name, NULL);
+	dl[n++] = critstrdup(mastr_str(p), "queueindex_find");
+	mastr_delete(p);
+    }
+    dl[n] = NULL;
+    return dl;
+}
@@ -0,0 +1,9 @@
+#ifndef QUEUEINDEX_H
+#define QUEUEINDEX_H
+
+void queueindex_add(const char *dir, const char *file, const char *msgid);
+void queueindex_remove(const char *dir, const char *file);
+/*@null@*/ /*@only@*/ char **queueindex_find(const char *dir,
+	const char *msgid);
+
+#endif
@@ -16,6 +16,7 @@
 
 #include "critmem.h"
 #include "mastring.h"
+#include "queueindex.h"
 
 /**
  * Check whether there are any articles in the queue dir.
@@ -70,6 +71,14 @@ checkincoming(void)
     return checkqueue("in.coming");
 }
 
+/** Removes \p file from in.coming and from its Message-ID index. */
+static void
+dequeue(const char *file)
+{
+    if (0 == log_unlink(file, 0))
+	queueindex_remove("in.coming", file);
+}
+
 /** Feeds all postings in $(SPOOLDIR)/in.coming/ into newsgroups
  * \return
  *  - TRUE in case of success
@@ -104,7 +113,7 @@ feedincoming(void)
 	if (!ngs) {
 	    ln_log(LNLOG_SERR, LNLOG_CARTICLE,
 		   "Cannot read Newsgroups from %s, deleting", *dl);
-	    log_unlink(*di, 0);
+	    dequeue(*di);
 	    log_fclose(f);
 	    continue;
 	}
@@ -112,7 +121,7 @@ feedincoming(void)
 	if ((forbidden = checkstatus(ngs, 'n'))) {
 	    ln_log(LNLOG_SNOTICE, LNLOG_CARTICLE,
 		    "Article was posted to non-writable group %s", forbidden);
-	    log_unlink(*di, 0);
+	    dequeue(*di);
 	    log_fclose(f);
 	    free(forbidden);
 	    free(ngs);
@@ -128,14 +137,15 @@ feedincoming(void)
 		ln_log(LNLOG_SERR, LNLOG_CARTICLE, "Could not store %s: \"%s\", "
 			"moving to %s/failed.postings/",
 			*di, store_err(rc), spooldir);
-		(void)log_moveto(*di, "/failed.postings/");
+		if (0 == log_moveto(*di, "/failed.postings/"))
+		    queueindex_remove("in.coming", *di);
 	    } else {
-		log_unlink(*di, 0);
+		dequeue(*di);
 	    }
 	} else {
 	    if (!good && !mod) ln_log(LNLOG_SNOTICE, LNLOG_CARTICLE,
 		    "Article was posted to unknown groups %s", ngs);
-	    log_unlink(*di, 0);
+	    dequeue(*di);
 	}
 	log_fclose(f);
 	if (good) free(good);
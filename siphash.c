@@ -0,0 +1,70 @@
+/** \file siphash.c
+ * SipHash-2-4 by Jean-Philippe Aumasson and Daniel J. Bernstein, a
+ * keyed hash that an attacker who does not know the key cannot steer
+ * into a single bucket. Written from the description in the paper
+ * "SipHash: a fast short-input PRF", 2012.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "siphash.h"
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+/** read 8 bytes little-endian */
+static uint64_t
+le64(const unsigned char *p)
+{
+    uint64_t r = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+	r = (r << 8) | p[i];
+    return r;
+}
+
+/** \return the SipHash-2-4 of \p len bytes at \p data under \p key */
+uint64_t
+siphash24(const unsigned char key[16], const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t k0 = le64(key), k1 = le64(key + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    uint64_t m, b = (uint64_t)len << 56;
+    size_t left = len;
+
+    for (; left >= 8; left -= 8, p += 8) {
+	m = le64(p);
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+    }
+    while (left--)
+	b |= (uint64_t)p[left] << (8 * left);
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
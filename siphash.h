@@ -0,0 +1,10 @@
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include "system.h"
+#include <sys/types.h>
+
+uint64_t siphash24(const unsigned char key[16], const void *data,
+	size_t len);
+
+#endif
@@ -18,6 +18,8 @@
 #include "ln_dir.h"
 #include "msgid.h"
 #include "link_force.h"
+#include "groupfd.h"
+#include "history.h"
 
 #include <ctype.h>
 #include <stdio.h>
@@ -30,6 +32,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #ifdef WITH_DMALLOC
 #include <dmalloc.h>
@@ -63,6 +66,92 @@
    - no second pass necessary to clean the .overview files up.
 */
 
+/* group commit state, see store_batch_begin() */
+static int batch_open = 0;		/* nonzero while a batch is open */
+static char **batch_files = NULL;	/* message.id names not yet synced */
+static size_t batch_count = 0;		/* used entries in batch_files */
+static size_t batch_size = 0;		/* allocated entries in batch_files */
+
+/** Open a group commit batch. Until store_batch_commit() is called,
+ * store_stream() does not fsync the articles it writes, but remembers
+ * them so that a single barrier can cover all of them. The caller must
+ * not publish anything that depends on the articles being on disk (the
+ * upstream water marks, for instance) before the batch is committed. */
+void
+store_batch_begin(void)
+{
+    batch_open = 1;
+}
+
+static void
+batch_remember(const char *m)
+{
+    if (batch_count == batch_size) {
+	batch_size = batch_size ? batch_size + batch_size : 64;
+	batch_files = (char **)critrealloc((char *)batch_files,
+		batch_size * sizeof(char *), "store_batch");
+    }
+    batch_files[batch_count++] = critstrdup(m, "store_batch");
+}
+
+/** Make all articles stored since store_batch_begin() durable and
+ * close the batch. Without syncfs(), each article is fsynced in turn,
+ * which still saves the stall between pipelined ARTICLE replies.
+ * \return 0 for success, -1 if the articles may not be on disk. */
+int
+store_batch_commit(void)
+{
+    int rc = 0;
+    size_t i;
+
+    batch_open = 0;
+    if (batch_count == 0)
+	return 0;
+
+#ifdef HAVE_SYNCFS
+    {
+	int fd = open(spooldir, O_RDONLY);
+
+	if (fd < 0 || syncfs(fd)) {
+	    ln_log(LNLOG_SERR, LNLOG_CTOP,
+		    "store: cannot sync file system of %s: %m", spooldir);
+	    rc = -1;
+	}
+	if (fd >= 0)
+	    (void)close(fd);
+    }
+#else
+    for (i = 0; i < batch_count; i++) {
+	int fd = open(batch_files[i], O_RDONLY);
+
+	if (fd < 0) {
+	    /* canceled or superseded within the batch */
+	    if (errno == ENOENT)
+		continue;
+	    ln_log(LNLOG_SERR, LNLOG_CARTICLE,
+		    "store: cannot open %s for fsync: %m", batch_files[i]);
+	    rc = -1;
+	    continue;
+	}
+	if (log_fsync(fd))
+	    rc = -1;
+	(void)close(fd);
+    }
+#endif
+
+    if (debugmode & DEBUG_STORE)
+	ln_log(LNLOG_SDEBUG, LNLOG_CTOP,
+		"store: committed batch of %lu articles, %s",
+		(unsigned long)batch_count, rc ? "failed" : "ok");
+
+    for (i = 0; i < batch_count; i++)
+	free(batch_files[i]);
+    free(batch_files);
+    batch_files = NULL;
+    batch_count = batch_size = 0;
+    return rc;
+}
+
 /*@observer@*/ const char *
 store_err(int i)
 {
@@ -85,6 +174,95 @@ store_err(int i)
     }
 }
 
+/** Update the time stamps of the LASTPOSTING file in the newsgroup
+ * directory \a dfd, creating it if needed. */
+static int
+touch_lastposting(int dfd)
+{
+    int fd;
+
+    if (0 == utimensat(dfd, LASTPOSTING, NULL, 0))
+	return 0;
+    if (errno != ENOENT)
+	return -1;
+    fd = openat(dfd, LASTPOSTING, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+	return -1;
+    return close(fd);
+}
+
+/** size of the blocks an NNTP article body is written in */
+#define BODYBLOCK (4 * BLOCKSIZE)
+
+/** Copy a dot-stuffed article body from \a in to \a out, up to the line
+ * with the lone dot, undoing the dot-stuffing and converting CRLF to LF.
+ * Lines are read with getdelim() and collected into a large block that
+ * is written in one go, rather than reading characters one by one and
+ * writing each line with two fputs() calls.
+ * \return
+ * -  1 if the terminating line was seen
+ * -  0 at end of file or read error
+ * - -1 for a write error
+ */
+static int
+copy_nntp_body(FILE *in, FILE *out,
+	long *bytes /** incremented by the bytes written */,
+	long *lines /** incremented by the lines written */)
+{
+    static char *block;
+    static char *line;
+    static size_t linesize;
+    size_t len = 0;
+    ssize_t got;
+    int rc = 0;
+
+    if (!block)
+	block = (char *)critmalloc(BODYBLOCK, "copy_nntp_body");
+
+    while ((got = getdelim(&line, &linesize, '\n', in)) > 0) {
+	size_t end = (size_t)got, n;
+	const char *p = line;
+
+	if (line[end - 1] == '\n') {
+	    end--;
+	    if (end && line[end - 1] == '\r')
+		end--;
+	}
+	/* like fputs, we do not write past a NUL byte */
+	n = strnlen(line, end);
+	if (*p == '.') {
+	    ++p;
+	    if (--n == 0) {
+		rc = 1;
+		break;		/* complete */
+	    }
+	}
+
+	if (len + n + 1 > BODYBLOCK) {
+	    if (len && fwrite(block, 1, len, out) != len)
+		return -1;
+	    len = 0;
+	    if (n + 1 > BODYBLOCK) {
+		/* huge line, bypass the block */
+		if (fwrite(p, 1, n, out) != n || fputs(LLS, out) == EOF)
+		    return -1;
+		*bytes += n + 1;
+		(*lines)++;
+		continue;
+	    }
+	}
+	memcpy(block + len, p, n);
+	len += n;
+	block[len++] = '\n';
+	*bytes += n + 1;
+	(*lines)++;
+    }
+
+    if (len && fwrite(block, 1, len, out) != len)
+	return -1;
+    return rc;
+}
+
 #define BAIL(r,msg) { rc = (r); if (*msg) ln_log(LNLOG_SERR, LNLOG_CARTICLE, ("store: " msg)); goto bail; }
 
 /** Read an article from input stream and store it into message.id and
@@ -123,7 +301,6 @@ store_stream(FILE * in /** input file */ ,
     int c_subject = 0;
     int c_path = 0;
     int ignore = 1;
-    int olddirfd = -1;		/* we save the cwd here */
     char **nglist = 0;		/* we save the newsgroups here */
     int nglistlen = 10;		/* how big did we allocate nglist */
     char **t = 0;
@@ -135,7 +312,12 @@ store_stream(FILE * in /** input file */ ,
     ssize_t s;
     mastr *ln = mastr_new(4095l);	/* line buffer */
     mastr *xowrite = mastr_new(4095l);	/* buffer for overview line */
-    char *ov = NULL;			/* hold getxoverline result */
+    char *ov = NULL;			/* hold xoverbuild_line result */
+    struct xoverbuild xob;		/* overview data, gathered on the fly */
+    long bytes = 0;			/* size of the stored article */
+    long lines = 0;			/* body lines of the stored article */
+
+    xoverbuild_init(&xob);
 
     (void)mastr_vcat(tmpfn, spooldir, "/temp.files/store_XXXXXXXXXX", NULL);
 
@@ -269,10 +451,12 @@ store_stream(FILE * in /** input file */ ,
 	    ;
 	}
 
+	xoverbuild_header(&xob, line);
 	if (fputs(line, tmpstream) == EOF)
 	    BAIL(-1, "write error");
 	if (fputs(LLS, tmpstream) == EOF)
 	    BAIL(-1, "write error");
+	bytes += strlen(line) + 1;
     }
 
     /* check if mandatory headers present exactly once */
@@ -320,10 +504,8 @@ store_stream(FILE * in /** input file */ ,
        newsgroup folders, generating the Xref: header, and writing
        it. */
 
-    /* save cwd */
-    olddirfd = open(".", O_RDONLY);
-    if (olddirfd < 0)
-	BAIL(-1, "cannot open current directory");
+    /* all group links share the inode, set its mode once */
+    (void)log_fchmod(fileno(tmpstream), 0660);
 
     /* parse ngs */
     /*@+loopexec@*/
@@ -364,9 +546,20 @@ store_stream(FILE * in /** input file */ ,
 	    if (g) {
 		int ls = 0;
 		int local;
-		(void)chdirgroup(name, TRUE);
-		if (touch_truncate(LASTPOSTING))
-		    BAIL(-1, "cannot touch " LASTPOSTING);
+		int dfd;
+		int tries;
+
+		for (tries = 0;; tries++) {
+		    dfd = groupfd_dir(name, TRUE);
+		    if (dfd < 0)
+			BAIL(-1, "cannot open newsgroup directory");
+		    if (0 == touch_lastposting(dfd))
+			/*@innerbreak@*/ break;
+		    if (errno != ENOENT || tries)
+			BAIL(-1, "cannot touch " LASTPOSTING);
+		    /* texpire removed the directory behind our back */
+		    groupfd_forget(name);
+		}
 
 		local = is_localgroup(g->name) ? 1 : 0;
 
@@ -382,19 +575,16 @@ store_stream(FILE * in /** input file */ ,
 		    str_ulong(nb, ++g->last);
 		    /* we use sync_link on the always-open file below */
 		    /* ls = !sync_link(tmpfn, nb); */
-		    ls = !link(mastr_str(tmpfn), nb);
-		    if (ls) {
-			if (log_chmod(nb, 0660) < 0) {
-				ls = -1;
-			}
+		    ls = !linkat(AT_FDCWD, mastr_str(tmpfn), dfd, nb, 0);
+		    if (ls)
 			/*@innerbreak@*/ break;
-		    }
 		    if (errno == EEXIST) {
 			int e;
 			ln_log(LNLOG_SWARNING, LNLOG_CARTICLE,
 			       "store: %s: stale water marks, trying to fix",
 			       name);
-			e = getwatermarks(&g->first, &g->last, &g->count);
+			e = getwatermarksat(dfd, &g->first, &g->last,
+				&g->count);
 			if (e != 0) {
 			    ln_log(LNLOG_SERR, LNLOG_CARTICLE,
 				   "store: %s: cannot obtain water marks",
@@ -426,35 +616,51 @@ store_stream(FILE * in /** input file */ ,
 	BAIL(-1, "write error");
     if (fputs(LLS, tmpstream) == EOF)
 	BAIL(-1, "write error");
+    bytes += 6 + strlen(fqdn) + mastr_len(xref) + 1;
+    {
+	mastr *x = mastr_new(1024l);
+
+	(void)mastr_vcat(x, "Xref: ", fqdn, mastr_str(xref), NULL);
+	xoverbuild_header(&xob, mastr_str(x));
+	mastr_delete(x);
+    }
 
     /* write separator between header and body */
     if (delayflg != 1) {
 	if (fputs(LLS, tmpstream) == EOF)
 	    BAIL(-1, "write error");
+	bytes++;
     }
 
     /* copy body */
-    while ((maxbytes > 0 || maxbytes == -1) &&
-	(s = mastr_getln(ln, in, maxbytes)) > 0) {
-	if (maxbytes != -1) maxbytes -= s;
-	mastr_chop(ln);
+    if (nntpmode) {
+	switch (copy_nntp_body(in, tmpstream, &bytes, &lines)) {
+	case -1:
+	    BAIL(-1, "write error");
+	case 1:
+	    ignore = 0;
+	    break;
+	default:
+	    ;
+	}
+    } else {
+	while ((maxbytes > 0 || maxbytes == -1) &&
+	    (s = mastr_getln(ln, in, maxbytes)) > 0) {
+	    if (maxbytes != -1) maxbytes -= s;
+	    mastr_chop(ln);
 #if 0
-	if (debugmode & DEBUG_STORE)
-	    ln_log(LNLOG_SDEBUG, LNLOG_CARTICLE,
-		    "store: read %s", mastr_str(ln));
+	    if (debugmode & DEBUG_STORE)
+		ln_log(LNLOG_SDEBUG, LNLOG_CARTICLE,
+			"store: read %s", mastr_str(ln));
 #endif
-	line = mastr_str(ln);
-	if (nntpmode && line[0] == '.') {
-	    ++line;
-	    if (!*line) {
-		ignore = 0;
-		break;		/* complete */
-	    }
+	    line = mastr_str(ln);
+	    if (fputs(line, tmpstream) == EOF)
+		BAIL(-1, "write error");
+	    if (fputs(LLS, tmpstream) == EOF)
+		BAIL(-1, "write error");
+	    bytes += strlen(line) + 1;
+	    lines++;
 	}
-	if (fputs(line, tmpstream) == EOF)
-	    BAIL(-1, "write error");
-	if (fputs(LLS, tmpstream) == EOF)
-	    BAIL(-1, "write error");
     }
 
     if (maxbytes > 0) {
@@ -488,7 +694,10 @@ store_stream(FILE * in /** input file */ ,
 	goto bail;
     }
   cont:
-    if (log_fsync(fileno(tmpstream))) {
+    if (batch_open) {
+	/* fsync deferred to store_batch_commit() */
+	batch_remember(m);
+    } else if (log_fsync(fileno(tmpstream))) {
 	ln_log(LNLOG_SERR, LNLOG_CARTICLE, "store: cannot fsync: %m");
 	(void)log_unlink(m, 0);
 	rc = -1;
@@ -501,12 +710,11 @@ store_stream(FILE * in /** input file */ ,
 	rc = -1;
 	goto bail;
     }
+    history_note(mid, HIST_PRESENT);
 
-    ov = getxoverline(0, mastr_str(tmpfn));
-    if (ov && !strchr(ov, '\t')) {
-	free(ov);
-	ov = NULL;
-    }
+    /* the overview line was gathered while copying the article,
+     * no need to read it back like getxoverline() would */
+    ov = xoverbuild_line(&xob, "", bytes, lines);
 
     /* iterate over XRef: group:number and update .overview */
     {
@@ -526,20 +734,18 @@ store_stream(FILE * in /** input file */ ,
 	    else *tt = '\0';
 	    /* now p has the number the article has in the current group */
 
-	    if (ov && chdirgroup(q, FALSE)) {
-		int fdo;
+	    if (ov) {
+		/* cached descriptor, don't close */
+		int fdo = groupfd_overview(q);
 
-		mastr_clear(xowrite);
-		mastr_vcat(xowrite, p, strchr(ov, '\t'), "\n", NULL);
-		fdo = open(".overview", O_WRONLY|O_APPEND|O_CREAT,
-			(mode_t)0660);
 		if (fdo >= 0) {
+		    mastr_clear(xowrite);
+		    mastr_vcat(xowrite, p, strchr(ov, '\t'), "\n", NULL);
 		    /* FIXME: will getxover cope with hosed
 		     * overview files? ENOSPC is a candidate... */
 		    (void)writes(fdo, mastr_str(xowrite));
 		    /* no fsync here, .overview is not precious as it
 		     * can be regenerated */
-		    (void)close(fdo);
 		}
 	    }
 	    q = tt;
@@ -574,10 +780,6 @@ bail:
 		}
 	    }
 	}
-	if (olddirfd >= 0) {
-	    (void)fchdir(olddirfd);
-	    (void)close(olddirfd);
-	}
 	if (xref)
 	    mastr_delete(xref);
 	if (mid)
@@ -591,6 +793,7 @@ bail:
 	if (ov) {
 	    free(ov);
 	}
+	xoverbuild_free(&xob);
 	mastr_delete(xowrite);
 	mastr_delete(ngs);
 	if (tmpstream) {
@@ -39,6 +39,10 @@ See README for restrictions on the use of this software.
 #include "format.h"
 #include "mastring.h"
 #include "msgid.h"
+#include "ln_dir.h"
+#include "history.h"
+#include "hdrcache.h"
+#include "threadidx.h"
 
 #ifdef SOCKS
 #include <socks.h>
@@ -65,6 +69,7 @@ See README for restrictions on the use of this software.
 static int dryrun = 0;		/* do not delete articles */
 static int use_atime = 1;	/* look for atime on articles to expire */
 static int repair_spool = 0;	/* repair mode */
+static int rehash_spool = 0;	/* move message.id to msgid_buckets */
 static int expire_threads = 1;	/* if whole threads are blocked from expiry */
 
 static char gdir[LN_PATH_MAX];		/* name of current group directory */
@@ -359,6 +364,110 @@ build_threadlist(unsigned long acount)
     return tl;
 }
 
+struct tisort {
+    unsigned long thread;
+    unsigned long mid;
+    unsigned long artno;
+    unsigned long idx;		/* index into xoverinfo */
+};
+
+static int
+_comptisort(const void *a, const void *b)
+{
+    const struct tisort *la = (const struct tisort *)a;
+    const struct tisort *lb = (const struct tisort *)b;
+
+    if (la->thread != lb->thread)
+	return (la->thread > lb->thread) - (la->thread < lb->thread);
+    if (la->mid != lb->mid)
+	return (la->mid > lb->mid) - (la->mid < lb->mid);
+    return (la->artno > lb->artno) - (la->artno < lb->artno);
+}
+
+/*
+ * zero terminate the Message-ID field of an XOVER line in place, like
+ * xoverthread() does, return it or "" if there is none
+ */
+static const char *
+xovermid(char *xoverline)
+{
+    char *p = xoverline, *q, *r;
+    int i;
+
+    for (i = 0; i < XO_MESSAGEID; ++i) {
+	if (!(p = strchr(p, '\t')))
+	    return "";
+	++p;
+    }
+    r = strchr(p, '\t');		/* end of the field */
+    if (!(p = strchr(p, '<')) || !(q = strchr(p, '>')) || (r && q > r))
+	return "";
+    *++q = '\0';
+    return p;
+}
+
+/*
+ * generate threadlist from the thread index opened with
+ * threadidx_open(), like build_threadlist() does from xoverinfo.
+ * return 0 if an article is missing from the index
+ */
+static int
+index_threadlist(unsigned long acount, struct thread **tl)
+{
+    unsigned long i, n, parent;
+    struct tisort *s;
+    struct thread *t = NULL;
+    struct rnode *r;
+
+    *tl = NULL;
+    s = (struct tisort *)critmalloc((acount + 1) * sizeof(struct tisort),
+				    "Allocating thread index sort");
+    for (i = n = 0; i < acount; ++i) {
+	if (xoverinfo[i].artno
+	    && xoverinfo[i].text
+	    && xoverinfo[i].exists) {
+	    if (!threadidx_get(xoverinfo[i].artno, &s[n].thread, &s[n].mid,
+			       &parent)) {
+		free(s);
+		return 0;
+	    }
+	    s[n].artno = xoverinfo[i].artno;
+	    s[n++].idx = i;
+	}
+    }
+    ln_sort(s, n, sizeof(struct tisort), _comptisort);
+    for (i = 0; i < n; ++i) {
+	if (i && s[i].thread == s[i - 1].thread
+	    && s[i].mid == s[i - 1].mid) {
+	    /* same Message-ID as the article before, duplicate */
+	    struct rnode dup;
+
+	    memset(&dup, 0, sizeof(dup));
+	    dup.artno = s[i].artno;
+	    expire_article(&dup);
+	    continue;
+	}
+	if (!i || s[i].thread != s[i - 1].thread) {
+	    if (t)
+		hash_thread(t);
+	    t = (struct thread *)critmalloc(sizeof(struct thread),
+					    "Allocating new thread");
+	    t->subthread = NULL;
+	    t->next = *tl;
+	    *tl = t;
+	}
+	/* updatedir() looks the article up in message.id */
+	r = newnode(xovermid(xoverinfo[s[i].idx].text), s[i].artno);
+	r->fthread = t;
+	r->nthread = t->subthread;
+	t->subthread = r;
+    }
+    if (t)
+	hash_thread(t);
+    free(s);
+    return 1;
+}
+
 /* free all rnodes and threads, empty hash table */
 static void
 free_threadlist(struct thread *threadlist)
@@ -457,7 +566,7 @@ updatedir(const char *groupname)
     for (i = 0; i < HASHSIZE; ++i) {
 	r = hashtab[i];
 	for (r = hashtab[i]; r; r = r->nhash) {
-	    if (r->artno && r->mid) {
+	    if (r->artno && r->mid && *r->mid) {
 		str_ulong(name, r->artno);
 		if (!stat(name, &st)
 		    && S_ISREG(st.st_mode)) {
@@ -813,7 +922,10 @@ doexpiregroup(struct newsgroup *g, const char *n, time_t expire)
 	    }
 	}
     }
-    threadlist = build_threadlist(xcount);
+    if (!threadidx_open(dryrun ? THREADIDX_NOWRITE : THREADIDX_UPDATE)
+	|| !index_threadlist(xcount, &threadlist))
+	threadlist = build_threadlist(xcount);
+    threadidx_close();
     totalthreads = count_threads(threadlist);
     updatedir(n);
     if (expire > 0) {
@@ -842,6 +954,9 @@ doexpiregroup(struct newsgroup *g, const char *n, time_t expire)
 
     if (!dryrun && !kept) {
 	texpire_log_unlink(".overview", gdir);
+	texpire_log_unlink(".overview.index", gdir);
+	texpire_log_unlink(".overview.threads", gdir);
+	hdrcache_remove();
 
 	if ((is_interesting(n) == 0)
             && (is_dormant(n) == 0))
@@ -894,6 +1009,11 @@ doexpiregroup(struct newsgroup *g, const char *n, time_t expire)
      */
     if (chdirgroup(n, FALSE)) {
 	xgetxover(1, NULL, 1);
+	/* drop the expired articles from the thread index */
+	if (!dryrun && kept) {
+	    (void)threadidx_open(THREADIDX_PRUNE);
+	    threadidx_close();
+	}
     }
     freexover();
 }
@@ -924,28 +1044,35 @@ expiregroups(const struct stringlisthead *l)
 static void
 expiremsgid(void)
 {
-    int n;
+    unsigned long n, dirs;
     char **dl, **di;
     struct stat st;
     mastr *s = mastr_new(LN_PATH_MAX);
+    const struct msgid_layout *layout = msgid_layout(0);
     unsigned long kept;
 
     deleted = kept = 0;
+    if (!layout) {
+	mastr_delete(s);
+	return;
+    }
+    if (!dryrun)
+	history_rebuild_begin();
 
-    for (n = 0; n < 1000; n++) {
+    dirs = msgid_layout_dirs(layout);
+    for (n = 0; n < dirs; n++) {
 	size_t slen;
-	char num[4];	/* 3 digits! */
 
-	sprintf(num, "%03d", n);
-	mastr_clear(s);
-	mastr_vcat(s, spooldir, "/message.id/", num, NULL);
+	msgid_layout_dir(s, layout, n);
 	slen = mastr_len(s);
 
 	if (chdir(mastr_str(s))) {
 	    if (errno == ENOENT) {
 		ln_log(LNLOG_SWARNING, LNLOG_CTOP,
 		       "creating missing directory %s", mastr_str(s));
-		mkdir(mastr_str(s), MKDIR_MODE);
+		(void)mastr_cat(s, "/");
+		(void)mkdir_parent(mastr_str(s), MKDIR_MODE);
+		(void)mastr_resizekeep(s, slen);
 	    }
 	    if (chdir(mastr_str(s))) {
 		ln_log(LNLOG_SERR, LNLOG_CTOP, "chdir %s: %m", mastr_str(s));
@@ -969,6 +1096,8 @@ expiremsgid(void)
 	    /* First, make sure that all wrongly-hashed
 	       articles are deleted. */
 	    m = lookup(*di);
+	    if (!m)
+		break;		/* layout became unknown */
 	    if (strncmp(m, mastr_str(s), slen) && !dryrun) {	/* FIXME: why strncmp? */
 		if (0 == log_unlink(*di, 0)) {
 		    ln_log(LNLOG_SDEBUG, LNLOG_CARTICLE,
@@ -982,9 +1111,14 @@ expiremsgid(void)
 			   LNLOG_CARTICLE,
 			   "%s/%s has less than 2 links, deleting", mastr_str(s), *di);
 		    deleted++;
+		    if (!dryrun)
+			history_rebuild_note(*di, HIST_EXPIRED, time(NULL));
 		} else {
 		    if (S_ISREG(st.st_mode)) {
 			kept++;
+			if (!dryrun)
+			    history_rebuild_note(*di, HIST_PRESENT,
+				    st.st_mtime);
 		    }
 		}
 	    }
@@ -995,6 +1129,113 @@ expiremsgid(void)
     ln_log(LNLOG_SINFO, LNLOG_CTOP,
 	   "message.id: %lu articles deleted, %lu kept", deleted, kept);
     mastr_delete(s);
+    /* remember expired Message-IDs for as long as articles are kept */
+    if (!dryrun)
+	(void)history_rebuild_commit(default_expire);
+}
+
+/** Move the articles in message.id to the layout that msgid_buckets
+ * asks for if \p start is set, or finish a move that was interrupted.
+ * The new layout is recorded first, together with the old one, so
+ * that readers find the articles that have not been moved yet (see
+ * lookup()). The spool stays online. */
+static void
+rehash(int start)
+{
+    const struct msgid_layout *p = msgid_layout(1);
+    struct msgid_layout from, to;
+    mastr *s = mastr_new(LN_PATH_MAX);
+    mastr *f = mastr_new(LN_PATH_MAX);
+    unsigned long n, dirs, moved = 0, failed = 0;
+    char **dl, **di;
+    struct stat st;
+
+    if (!msgid_layout(0))
+	goto out;		/* unknown layout, logged */
+    if (p) {
+	from = *p;
+	to = *msgid_layout(0);
+	ln_log(LNLOG_SINFO, LNLOG_CTOP,
+		"message.id: resuming interrupted rehash");
+    } else {
+	from = *msgid_layout(0);
+	if (!start)
+	    goto out;
+	if (from.version == 2 && from.buckets == msgid_buckets) {
+	    ln_log(LNLOG_SINFO, LNLOG_CTOP,
+		    "message.id: already hashed into %lu directories",
+		    msgid_buckets);
+	    goto out;
+	}
+	if (dryrun) {
+	    ln_log(LNLOG_SINFO, LNLOG_CTOP,
+		    "message.id: would rehash into %lu directories",
+		    msgid_buckets);
+	    goto out;
+	}
+	msgid_layout_new(&to, msgid_buckets);
+	if (msgid_layout_set(&to, &from))
+	    goto out;
+    }
+    if (dryrun)
+	goto out;
+
+    dirs = msgid_layout_dirs(&from);
+    for (n = 0; n < dirs; n++) {
+	msgid_layout_dir(s, &from, n);
+	dl = dirlist(mastr_str(s), DIRLIST_NONDOT, NULL);
+	if (!dl) {
+	    if (errno != ENOENT) {
+		ln_log(LNLOG_SERR, LNLOG_CTOP,
+			"cannot open directory %s: %m", mastr_str(s));
+		failed++;
+	    }
+	    continue;
+	}
+	for (di = dl; *di; di++) {
+	    const char *m;
+
+	    mastr_clear(f);
+	    (void)mastr_vcat(f, mastr_str(s), "/", *di, NULL);
+	    /* version 1 directories hold the version 2 subdirectories */
+	    if (lstat(mastr_str(f), &st) || !S_ISREG(st.st_mode))
+		continue;
+	    m = lookup_layout(&to, *di);
+	    /* between two version 2 layouts the directory names overlap:
+	     * entries moved into a directory that is scanned later, or
+	     * by an interrupted run, are already in place. Linking them
+	     * onto themselves fails with EEXIST and the unlink below
+	     * would remove the only copy. */
+	    if (!strcmp(m, mastr_str(f)))
+		continue;
+	    if (link(mastr_str(f), m) && errno == ENOENT
+		    && 0 == mkdir_parent(m, MKDIR_MODE))
+		(void)link(mastr_str(f), m);
+	    /* EEXIST: moved by an interrupted run */
+	    if (stat(m, &st) || log_unlink(mastr_str(f), 0)) {
+		ln_log(LNLOG_SERR, LNLOG_CARTICLE,
+			"cannot move %s to %s: %m", mastr_str(f), m);
+		failed++;
+	    } else {
+		moved++;
+	    }
+	}
+	free_dirlist(dl);
+	if (from.version == 2)
+	    (void)rmdir(mastr_str(s));	/* fails unless empty */
+    }
+
+    ln_log(LNLOG_SINFO, LNLOG_CTOP,
+	    "message.id: %lu articles moved to %lu directories, %lu failed",
+	    moved, to.buckets, failed);
+    if (failed)
+	ln_log(LNLOG_SERR, LNLOG_CTOP,
+		"message.id: rehash incomplete, texpire will retry");
+    else
+	(void)msgid_layout_set(&to, NULL);
+out:
+    mastr_delete(f);
+    mastr_delete(s);
 }
 
 static void
@@ -1008,6 +1249,7 @@ usage(void)
     fprintf(stderr,
 	    "    -a             - expire individual articles (earlier) rather than threads\n"
 	    "    -f             - force expire irrespective of access time\n"
+	    "    -H             - rehash message.id into msgid_buckets directories\n"
 	    "    -n             - dry run mode, do not delete anything\n"
 	    "    -r             - relink articles with message.id tree\n"
 	    "    -C             - switch to cancel mode\n"
@@ -1026,7 +1268,7 @@ main(int argc, char **argv)
     if (!initvars(argv[0], 0))
 	init_failed(myname);
 
-    while ((option = getopt(argc, argv, GLOBALOPTS "aCfnr")) != -1) {
+    while ((option = getopt(argc, argv, GLOBALOPTS "aCfHnr")) != -1) {
 	if (parseopt(myname, option, optarg, &conffile))
 	    continue;
 	switch (option) {
@@ -1039,6 +1281,9 @@ main(int argc, char **argv)
 	case 'r':
 	    repair_spool = 1;
 	    break;
+	case 'H':
+	    rehash_spool = 1;
+	    break;
 	case 'n':
 	    dryrun = 1;
 	    break;
@@ -1077,6 +1322,14 @@ main(int argc, char **argv)
 	exit(2);
     }
 
+    /* an unknown message.id layout makes every article look wrongly
+     * hashed, do not touch the spool */
+    if (!msgid_layout(0)) {
+	fprintf(stderr, "Unknown message.id layout, exiting "
+		"(see syslog for more information).\n");
+	exit(2);
+    }
+
     switch (mode) {
 	case TEM_expire:
 	    if (verbose) {
@@ -1116,6 +1369,7 @@ main(int argc, char **argv)
 	    /* actual main loop */
 	    expiregroups(g);
 	    freelist(g);
+	    rehash(rehash_spool);
 	    expiremsgid();
 	    }
 	    break;
@@ -1128,6 +1382,7 @@ main(int argc, char **argv)
 		}
 		optind++;
 	    }
+	    delete_article_flush();
 	    break;
 	default:
 	    abort();
@@ -0,0 +1,460 @@
+/** \file threadidx.c
+ * Persistent thread index of a newsgroup.
+ *
+ * texpire keeps threads together when it expires articles, and
+ * newsreaders rebuild threads from the References of every overview
+ * line. Both used to parse all Message-IDs of the group each time.
+ * <group>/.overview.threads keeps the result: a union-find forest over
+ * the Message-IDs of the articles and of everything they reference,
+ * each represented by its SipHash, and for every article the nodes of
+ * its Message-ID and of its parent, the last reference.
+ *
+ * threadidx_open() loads the file and adds the overview entries it does
+ * not know yet; after the first time these are only the articles that
+ * store appended since. texpire saves the index pruned to the threads
+ * that still have articles, nntpd serves it with XTHREAD.
+ *
+ * The file holds, in host byte order, a struct tihead, the 64-bit
+ * hashes and the 32-bit forest links of the nodes, and the struct tiart
+ * of the articles, sorted by article number.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+#include "critmem.h"
+#include "ln_log.h"
+#include "sgetcwd.h"
+#include "siphash.h"
+#include "threadidx.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#define TI_MAGIC "LNTHRD1"
+#define TI_FILE ".overview.threads"
+#define TI_NONE 0xffffffffUL	/* no node, or no parent */
+
+struct tihead {
+    char magic[8];
+    uint64_t nnodes;
+    uint64_t narts;
+};
+
+struct tiart {
+    uint32_t artno;
+    uint32_t node;		/* its Message-ID */
+    uint32_t parent;		/* its last reference, or TI_NONE */
+};
+
+static const unsigned char tikey[16] = "leafnode-thread";
+
+static struct {
+    int active;
+    int dirty;			/* differs from the file */
+    unsigned long gen;		/* xovergen of the overview */
+    unsigned long count;	/* overview entries looked at */
+    uint64_t *hash;		/* per node, 0 for articles without ID */
+    uint32_t *up;		/* per node, itself for roots */
+    uint32_t *first;		/* per node, lowest article with this ID */
+    uint32_t *low;		/* per root, lowest article of the thread */
+    unsigned long nnodes, nodesize;
+    uint32_t *tab;		/* node + 1 by hash, 0 if free */
+    unsigned long tabsize;
+    struct tiart *art;
+    unsigned long nart, artsize;
+    unsigned long sorted;	/* art[0..sorted) is sorted */
+} ti;
+
+static int
+_comptiart(const void *a, const void *b)
+{
+    const struct tiart *la = (const struct tiart *)a;
+    const struct tiart *lb = (const struct tiart *)b;
+
+    return (la->artno > lb->artno) - (la->artno < lb->artno);
+}
+
+static uint32_t
+minnz(uint32_t a, uint32_t b)
+{
+    return !a ? b : !b ? a : a < b ? a : b;
+}
+
+static uint32_t
+ti_root(uint32_t x)
+{
+    while (ti.up[x] != x) {
+	ti.up[x] = ti.up[ti.up[x]];
+	x = ti.up[x];
+    }
+    return x;
+}
+
+static void
+ti_union(uint32_t a, uint32_t b)
+{
+    a = ti_root(a);
+    b = ti_root(b);
+    if (a == b)
+	return;
+    if (b < a) {
+	uint32_t t = a;
+
+	a = b;
+	b = t;
+    }
+    ti.up[b] = a;
+    ti.low[a] = minnz(ti.low[a], ti.low[b]);
+    ti.dirty = 1;
+}
+
+static void
+ti_insert(unsigned long n)
+{
+    unsigned long i;
+
+    for (i = (unsigned long)ti.hash[n] & (ti.tabsize - 1); ti.tab[i];
+	    i = (i + 1) & (ti.tabsize - 1))
+	;
+    ti.tab[i] = (uint32_t)(n + 1);
+}
+
+static void
+ti_rehash(void)
+{
+    unsigned long n;
+
+    for (ti.tabsize = 1024; ti.tabsize < 2 * ti.nnodes + 2; ti.tabsize *= 2)
+	;
+    free(ti.tab);
+    ti.tab = (uint32_t *)critmalloc(ti.tabsize * sizeof(uint32_t),
+	    "ti_rehash");
+    memset(ti.tab, 0, ti.tabsize * sizeof(uint32_t));
+    for (n = 0; n < ti.nnodes; n++)
+	if (ti.hash[n])
+	    ti_insert(n);
+}
+
+static void
+ti_nodes(unsigned long size)
+{
+    ti.nodesize = size;
+    ti.hash = (uint64_t *)critrealloc((char *)ti.hash,
+	    size * sizeof(uint64_t), "ti_nodes");
+    ti.up = (uint32_t *)critrealloc((char *)ti.up,
+	    size * sizeof(uint32_t), "ti_nodes");
+    ti.first = (uint32_t *)critrealloc((char *)ti.first,
+	    size * sizeof(uint32_t), "ti_nodes");
+    ti.low = (uint32_t *)critrealloc((char *)ti.low,
+	    size * sizeof(uint32_t), "ti_nodes");
+}
+
+/** \return the node of the Message-ID of \p len bytes at \p p, a new
+ * one if it is not known or \p p is NULL */
+static uint32_t
+ti_node(/*@null@*/ const char *p, size_t len)
+{
+    uint64_t h = 0;
+    unsigned long i, n;
+
+    if (p) {
+	if (!(h = siphash24(tikey, p, len)))
+	    h = 1;
+	for (i = (unsigned long)h & (ti.tabsize - 1); ti.tab[i];
+		i = (i + 1) & (ti.tabsize - 1))
+	    if (ti.hash[ti.tab[i] - 1] == h)
+		return ti.tab[i] - 1;
+    }
+    if (ti.nnodes == ti.nodesize)
+	ti_nodes(2 * ti.nodesize + 1024);
+    n = ti.nnodes++;
+    ti.hash[n] = h;
+    ti.up[n] = (uint32_t)n;
+    ti.first[n] = ti.low[n] = 0;
+    ti.dirty = 1;
+    if (h) {
+	if (2 * ti.nnodes + 2 > ti.tabsize)
+	    ti_rehash();
+	else
+	    ti_insert(n);
+    }
+    return (uint32_t)n;
+}
+
+/** add article \p artno with the Message-ID and References fields of
+ * its overview line. Message-IDs are found like texpire always did. */
+static void
+ti_addart(unsigned long artno, /*@null@*/ const char *mid, size_t mlen,
+	/*@null@*/ const char *refs, size_t rlen)
+{
+    const char *p, *q, *s;
+    uint32_t node, parent = TI_NONE;
+
+    if (mid && (p = (const char *)memchr(mid, '<', mlen))
+	    && (q = (const char *)memchr(p, '>', (size_t)(mid + mlen - p))))
+	node = ti_node(p, (size_t)(q + 1 - p));
+    else
+	node = ti_node(NULL, 0);
+    for (p = refs; p && p < refs + rlen
+	    && (q = (const char *)memchr(p, '>', (size_t)(refs + rlen - p)));
+	    p = q + 1) {
+	for (s = q; s > p && *s != '<'; s--)
+	    ;
+	if (*s == '<') {
+	    parent = ti_node(s, (size_t)(q + 1 - s));
+	    ti_union(node, parent);
+	}
+    }
+    if (ti.nart == ti.artsize) {
+	ti.artsize = 2 * ti.artsize + 1024;
+	ti.art = (struct tiart *)critrealloc((char *)ti.art,
+		ti.artsize * sizeof(struct tiart), "ti_addart");
+    }
+    ti.art[ti.nart].artno = (uint32_t)artno;
+    ti.art[ti.nart].node = node;
+    ti.art[ti.nart++].parent = parent;
+    ti.dirty = 1;
+}
+
+/*@null@*/ /*@dependent@*/ static struct tiart *
+ti_findart(unsigned long artno)
+{
+    struct tiart key;
+
+    key.artno = (uint32_t)artno;
+    return (struct tiart *)bsearch(&key, ti.art, ti.sorted,
+	    sizeof(struct tiart), _comptiart);
+}
+
+/** read .overview.threads of the current directory, or start empty */
+static void
+ti_load(void)
+{
+    struct tihead h;
+    struct stat st;
+    unsigned long i;
+    FILE *f;
+
+    if (!(f = fopen(TI_FILE, "r")))
+	goto empty;
+    if (fstat(fileno(f), &st)
+	    || fread(&h, sizeof(h), 1, f) != 1
+	    || memcmp(h.magic, TI_MAGIC, sizeof(h.magic))
+	    || h.nnodes >= TI_NONE || h.narts >= TI_NONE
+	    || (uint64_t)st.st_size != sizeof(h) + h.nnodes * 12
+		+ h.narts * sizeof(struct tiart))
+	goto bad;
+    ti.nnodes = (unsigned long)h.nnodes;
+    ti.nart = ti.artsize = (unsigned long)h.narts;
+    ti_nodes(ti.nnodes + 1024);
+    if (ti.nart)
+	ti.art = (struct tiart *)critmalloc(ti.nart * sizeof(struct tiart),
+		"ti_load");
+    if (fread(ti.hash, sizeof(uint64_t), ti.nnodes, f) != ti.nnodes
+	    || fread(ti.up, sizeof(uint32_t), ti.nnodes, f) != ti.nnodes
+	    || fread(ti.art, sizeof(struct tiart), ti.nart, f) != ti.nart)
+	goto bad;
+    for (i = 0; i < ti.nnodes; i++)
+	if (ti.up[i] >= ti.nnodes)
+	    goto bad;
+    for (i = 0; i < ti.nart; i++)
+	if (ti.art[i].node >= ti.nnodes
+		|| (ti.art[i].parent != TI_NONE
+		    && ti.art[i].parent >= ti.nnodes)
+		|| (i && ti.art[i].artno <= ti.art[i - 1].artno))
+	    goto bad;
+    (void)fclose(f);
+    memset(ti.first, 0, ti.nnodes * sizeof(uint32_t));
+    memset(ti.low, 0, ti.nnodes * sizeof(uint32_t));
+    ti.sorted = ti.nart;
+    ti_rehash();
+    return;
+
+bad:
+    ln_log(LNLOG_SNOTICE, LNLOG_CGROUP, "%s/%s is damaged, rebuilding it",
+	    sgetcwd(), TI_FILE);
+    ti.nnodes = ti.nart = 0;
+    (void)fclose(f);
+empty:
+    ti.dirty = 1;
+    ti_rehash();
+}
+
+/** write the index to .overview.threads. With \p prune, leave out the
+ * articles that are no longer in the overview and the threads that
+ * lost all their articles. Failure is not an error, nntpd may lack
+ * write permission. */
+static void
+ti_write(int prune)
+{
+    char newfile[] = TI_FILE ".XXXXXX";
+    struct tihead h;
+    uint32_t *map;
+    char *keep;
+    unsigned long i, nn;
+    FILE *w;
+    int wfd;
+
+    map = (uint32_t *)critmalloc((ti.nnodes + 1) * sizeof(uint32_t),
+	    "ti_write");
+    keep = (char *)critmalloc(ti.nart + 1, "ti_write");
+    for (i = nn = 0; i < ti.nnodes; i++)
+	map[i] = !prune || ti.low[ti_root((uint32_t)i)] ? nn++ : TI_NONE;
+    memset(keep, !prune, ti.nart);
+    if (prune) {
+	for (i = 0; i < xcount; i++) {
+	    struct tiart *a = ti_findart(xoverartno(i));
+
+	    if (a)
+		keep[a - ti.art] = 1;
+	}
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TI_MAGIC, sizeof(h.magic));
+    h.nnodes = nn;
+    for (i = 0; i < ti.nart; i++)
+	h.narts += keep[i];
+
+    if ((wfd = mkstemp(newfile)) == -1 || !(w = fdopen(wfd, "w"))) {
+	ln_log(LNLOG_SDEBUG, LNLOG_CGROUP, "cannot create new %s: %m",
+		TI_FILE);
+	if (wfd != -1) {
+	    (void)close(wfd);
+	    (void)unlink(newfile);
+	}
+	free(map);
+	free(keep);
+	return;
+    }
+    (void)fchmod(wfd, (mode_t)0660);
+    (void)fwrite(&h, sizeof(h), 1, w);
+    for (i = 0; i < ti.nnodes; i++)
+	if (map[i] != TI_NONE)
+	    (void)fwrite(&ti.hash[i], sizeof(uint64_t), 1, w);
+    for (i = 0; i < ti.nnodes; i++)
+	if (map[i] != TI_NONE)
+	    (void)fwrite(&map[ti.up[i]], sizeof(uint32_t), 1, w);
+    for (i = 0; i < ti.nart; i++) {
+	struct tiart a = ti.art[i];
+
+	if (!keep[i])
+	    continue;
+	a.node = map[a.node];
+	if (a.parent != TI_NONE)
+	    a.parent = map[a.parent];
+	(void)fwrite(&a, sizeof(a), 1, w);
+    }
+    if (ferror(w) || fclose(w) || rename(newfile, TI_FILE)) {
+	ln_log(LNLOG_SERR, LNLOG_CGROUP, "cannot write %s/%s: %m",
+		sgetcwd(), TI_FILE);
+	(void)unlink(newfile);
+    } else {
+	ti.dirty = 0;
+    }
+    free(map);
+    free(keep);
+}
+
+/**
+ * Load the thread index of the current group directory and add the
+ * entries of the overview read by xgetxover() or xmapxover() that it
+ * lacks. Called again for the same overview, only the entries appended
+ * since are looked at.
+ * \return 1 for success, 0 if the index cannot be used: article
+ * numbers beyond 32 bits
+ */
+int
+threadidx_open(int mode)
+{
+    unsigned long i, start = 0;
+
+    if (ti.active && ti.gen == xovergen && ti.count <= xcount)
+	start = ti.count;
+    else {
+	threadidx_close();
+	ti_load();
+    }
+    for (i = start; i < xcount; i++) {
+	unsigned long artno = xoverartno(i);
+	struct tiart *a;
+	uint32_t r;
+
+	if (artno == 0)
+	    continue;
+	if (artno >= TI_NONE) {
+	    threadidx_close();
+	    return 0;
+	}
+	if (!(a = ti_findart(artno))) {
+	    size_t mlen = 0, rlen = 0;
+	    const char *mid = xoverfield(i, XO_MESSAGEID, &mlen);
+	    const char *refs = xoverfield(i, XO_REFERENCES, &rlen);
+
+	    ti_addart(artno, mid, mlen, refs, rlen);
+	    a = ti.art + ti.nart - 1;
+	}
+	ti.first[a->node] = minnz(ti.first[a->node], (uint32_t)artno);
+	r = ti_root(a->node);
+	ti.low[r] = minnz(ti.low[r], (uint32_t)artno);
+    }
+    if (ti.nart > ti.sorted) {
+	unsigned long j;
+
+	ln_sort(ti.art, ti.nart, sizeof(struct tiart), _comptiart);
+	/* the same article number twice in .overview */
+	for (i = j = 1; i < ti.nart; i++)
+	    if (ti.art[i].artno != ti.art[j - 1].artno)
+		ti.art[j++] = ti.art[i];
+	ti.nart = ti.sorted = ti.nart ? j : 0;
+    }
+    ti.active = 1;
+    ti.gen = xovergen;
+    ti.count = xcount;
+    if (mode == THREADIDX_PRUNE || (mode == THREADIDX_UPDATE && ti.dirty))
+	ti_write(mode == THREADIDX_PRUNE);
+    return 1;
+}
+
+/**
+ * Look up article \p artno of the overview given to threadidx_open().
+ * \return 1 with the lowest article number of its thread in \p thread,
+ * a number that is equal for articles with the same Message-ID in \p
+ * mid and the article it directly follows up to or 0 in \p parent,
+ * or 0 if the article is unknown
+ */
+int
+threadidx_get(unsigned long artno, /*@out@*/ unsigned long *thread,
+	/*@out@*/ unsigned long *mid, /*@out@*/ unsigned long *parent)
+{
+    struct tiart *a;
+
+    if (!ti.active || artno >= TI_NONE || !(a = ti_findart(artno)))
+	return 0;
+    *thread = ti.low[ti_root(a->node)];
+    *mid = a->node;
+    *parent = a->parent != TI_NONE ? ti.first[a->parent] : 0;
+    return *thread != 0;
+}
+
+void
+threadidx_close(void)
+{
+    free(ti.hash);
+    free(ti.up);
+    free(ti.first);
+    free(ti.low);
+    free(ti.tab);
+    free(ti.art);
+    memset(&ti, 0, sizeof(ti));
+}
@@ -0,0 +1,13 @@
+#ifndef THREADIDX_H
+#define THREADIDX_H
+
+#define THREADIDX_NOWRITE 0	/* do not touch .overview.threads */
+#define THREADIDX_UPDATE 1	/* save articles added to the index */
+#define THREADIDX_PRUNE 2	/* save only threads with articles left */
+
+int threadidx_open(int mode);
+int threadidx_get(unsigned long artno, /*@out@*/ unsigned long *thread,
+	/*@out@*/ unsigned long *mid, /*@out@*/ unsigned long *parent);
+void threadidx_close(void);
+
+#endif
@@ -1,4 +1,7 @@
 #include "leafnode.h"
+#include "critmem.h"
+
+#include <string.h>
 
 #ifdef WITH_DMALLOC
 #include <dmalloc.h>
@@ -152,6 +155,343 @@ wildmat(const char *text, const char *p)
     return (DoMatch(text, p) == TRUE) ? TRUE : FALSE;
 }
 
+/**************************************************************************/
+/*
+ * Compiled patterns. wildpat_compile() translates a wildmat pattern once
+ * into tokens: literal bytes, '?', and character classes as 256-bit
+ * sets. The stars cut the tokens into segments. The first segment must
+ * match at the start of the text, the last one at its end, and those in
+ * between are searched left to right; taking the leftmost match of each
+ * never loses a match, so no backtracking is needed and every text is
+ * matched in about one pass.
+ *
+ * Each segment remembers its longest run of literal bytes. The search
+ * for a segment looks for that run with memchr() and memcmp() first and
+ * compares the rest of the segment only where the run occurs.
+ *
+ * The classes are computed by running DoMatch's class code for every
+ * byte, so that odd patterns like "[]-]" or signed ranges give the same
+ * results as wildmat().
+ */
+
+#define WT_ANY	256		/* token for '?', classes follow */
+
+struct wildseg {
+    size_t off;			/* first token */
+    size_t n;			/* number of tokens */
+    size_t runoff;		/* longest literal run in this segment */
+    size_t runlen;
+};
+
+struct wildpat {
+    /*@null@*/ /*@only@*/ struct wildpat *next;	/* alternative */
+    int star;			/* pattern has a star */
+    size_t minlen;		/* shortest matching text */
+    size_t nseg;
+    struct wildseg *seg;
+    unsigned int *tok;	/* bytes, WT_ANY, or WT_ANY + 1 + class */
+    unsigned char *lit;		/* the literal bytes, by token */
+    unsigned char (*cls)[32];
+    size_t ncls;
+};
+
+/* evaluate the character class at p for c exactly as DoMatch does,
+ * return the address of the closing bracket (or the NUL) */
+static const char *
+classend(const char *p, int c, int *hit)
+{
+    int last, matched = FALSE, reverse;
+    char t = (char)c;
+
+    reverse = p[1] == NEGATE_CLASS ? TRUE : FALSE;
+    if (reverse)
+	p++;
+    if (p[1] == ']' || p[1] == '-')
+	if (*++p == t)
+	    matched = TRUE;
+    for (last = *p; *++p && *p != ']'; last = *p)
+	if (*p == '-' && p[1] != ']' && p[1] != '\0'
+	    ? t <= *++p && t >= last : t == *p)
+	    matched = TRUE;
+    *hit = matched != reverse;
+    return p;
+}
+
+/* make token n an empty class, return its set */
+static unsigned char *
+newclass(struct wildpat *w, size_t n)
+{
+    w->cls = (unsigned char (*)[32])critrealloc((char *)w->cls,
+	    (w->ncls + 1) * sizeof(*w->cls), "wildpat_compile");
+    memset(w->cls[w->ncls], 0, sizeof(*w->cls));
+    w->lit[n] = 0;
+    w->tok[n] = WT_ANY + 1 + w->ncls;
+    return w->cls[w->ncls++];
+}
+
+/** compile a wildmat pattern, see wildmat() for the syntax.
+ * \return the compiled pattern, free with wildpat_free() */
+/*@only@*/ struct wildpat *
+wildpat_compile(const char *p)
+{
+    struct wildpat *w = (struct wildpat *)critmalloc(sizeof(*w),
+	    "wildpat_compile");
+    size_t max = strlen(p) + 1, ntok = 0, i;
+    struct wildseg *s;
+
+    memset(w, 0, sizeof(*w));
+    w->tok = (unsigned int *)critmalloc(max * sizeof(*w->tok),
+	    "wildpat_compile");
+    w->lit = (unsigned char *)critmalloc(max, "wildpat_compile");
+    w->seg = (struct wildseg *)critmalloc(max * sizeof(*w->seg),
+	    "wildpat_compile");
+    s = w->seg;
+    memset(s, 0, sizeof(*s));
+    for (; *p; p++) {
+	switch (*p) {
+	case '*':
+	    while (p[1] == '*')
+		p++;
+	    w->star = 1;
+	    s->n = ntok - s->off;
+	    s++;
+	    memset(s, 0, sizeof(*s));
+	    s->off = ntok;
+	    continue;
+	case '?':
+	    w->lit[ntok] = 0;
+	    w->tok[ntok++] = WT_ANY;
+	    continue;
+	case '[':
+	    {
+		const char *e = p;
+		int c, hit;
+
+		unsigned char *set = newclass(w, ntok++);
+
+		for (c = 1; c < 256; c++) {
+		    e = classend(p, c, &hit);
+		    if (hit)
+			set[c >> 3] |= 1 << (c & 7);
+		}
+		p = *e ? e : e - 1;
+	    }
+	    continue;
+	case '\\':
+	    if (p[1] == '\0') {
+		/* a trailing backslash never matches, use an empty class */
+		(void)newclass(w, ntok++);
+		continue;
+	    }
+	    p++;
+	    /* FALLTHROUGH */
+	default:
+	    w->lit[ntok] = (unsigned char)*p;
+	    w->tok[ntok++] = (unsigned char)*p;
+	    continue;
+	}
+    }
+    s->n = ntok - s->off;
+    w->nseg = s - w->seg + 1;
+    w->minlen = ntok;
+
+    /* find the longest literal run of each segment */
+    for (s = w->seg; s < w->seg + w->nseg; s++) {
+	size_t run = 0;
+
+	for (i = 0; i < s->n; i++) {
+	    if (w->tok[s->off + i] < WT_ANY) {
+		if (++run > s->runlen) {
+		    s->runlen = run;
+		    s->runoff = i + 1 - run;
+		}
+	    } else {
+		run = 0;
+	    }
+	}
+    }
+    return w;
+}
+
+/** compile the patterns of a string list into one pattern that matches
+ * if any of them matches, like matchlist().
+ * \return the compiled patterns or NULL if the list is empty */
+/*@null@*/ /*@only@*/ struct wildpat *
+wildpat_compilelist(const struct stringlistnode *a)
+{
+    struct wildpat *w = NULL, **tail = &w;
+
+    for (; a->next; a = a->next) {
+	*tail = wildpat_compile(a->string);
+	tail = &(*tail)->next;
+    }
+    return w;
+}
+
+void
+wildpat_free(/*@null@*/ /*@only@*/ struct wildpat *w)
+{
+    while (w) {
+	struct wildpat *n = w->next;
+
+	free(w->tok);
+	free(w->lit);
+	free(w->seg);
+	free(w->cls);
+	free(w);
+	w = n;
+    }
+}
+
+/* does segment s match at t? */
+static int
+segmatch(const struct wildpat *w, const struct wildseg *s,
+	const unsigned char *t)
+{
+    const unsigned int *k = w->tok + s->off;
+    size_t i;
+
+    for (i = 0; i < s->n; i++) {
+	unsigned int x = k[i], c = t[i];
+
+	if (x < WT_ANY) {
+	    if (c != x)
+		return 0;
+	} else if (x > WT_ANY) {
+	    if (!(w->cls[x - WT_ANY - 1][c >> 3] & (1 << (c & 7))))
+		return 0;
+	} else if (c == 0) {
+	    /* DoMatch's text ends there */
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* find the leftmost match of segment s that starts at or after t and
+ * ends before end */
+/*@null@*/ static const unsigned char *
+segfind(const struct wildpat *w, const struct wildseg *s,
+	const unsigned char *t, const unsigned char *end)
+{
+    const unsigned char *r, *last;
+
+    if ((size_t)(end - t) < s->n)
+	return NULL;
+    last = end - s->n;
+    if (s->runlen == 0) {
+	for (; t <= last; t++)
+	    if (segmatch(w, s, t))
+		return t;
+	return NULL;
+    }
+    r = w->lit + s->off + s->runoff;
+    for (t += s->runoff; t <= last + s->runoff; t++) {
+	t = (const unsigned char *)memchr(t, *r,
+		(size_t)(last + s->runoff - t) + 1);
+	if (!t)
+	    return NULL;
+	if (!memcmp(t + 1, r + 1, s->runlen - 1)
+		&& segmatch(w, s, t - s->runoff))
+	    return t - s->runoff;
+    }
+    return NULL;
+}
+
+static int
+wildpat_match1(const struct wildpat *w, const unsigned char *t, size_t len)
+{
+    const struct wildseg *s = w->seg, *e = w->seg + w->nseg - 1;
+    const unsigned char *end = t + len;
+
+    if (len < w->minlen || (!w->star && len != w->minlen))
+	return FALSE;
+    if (!segmatch(w, s, t))
+	return FALSE;
+    if (!w->star)
+	return TRUE;
+    if (!segmatch(w, e, end - e->n))
+	return FALSE;
+    t += s->n;
+    end -= e->n;
+    for (s++; s < e; s++) {
+	if (!(t = segfind(w, s, t, end)))
+	    return FALSE;
+	t += s->n;
+    }
+    return TRUE;
+}
+
+/** match the \p len bytes at \p text against \p w or its alternatives.
+ * The text need not be NUL-terminated.
+ * \return TRUE if the text matches, FALSE if not */
+int
+wildpat_match(const struct wildpat *w, const char *text, size_t len)
+{
+    for (; w; w = w->next)
+	if (wildpat_match1(w, (const unsigned char *)text, len))
+	    return TRUE;
+    return FALSE;
+}
+
+/** \return the next alternative of \p w, see wildpat_compilelist() */
+/*@null@*/ /*@observer@*/ const struct wildpat *
+wildpat_next(const struct wildpat *w)
+{
+    return w->next;
+}
+
+/** store up to \p max runs of at least \p min literal bytes that every
+ * text matching \p w itself (not its alternatives) contains in \p run
+ * and \p len. The runs are not NUL-terminated.
+ * \return the number of runs stored */
+size_t
+wildpat_literals(const struct wildpat *w, size_t min,
+	/*@out@*/ const char **run, /*@out@*/ size_t *len, size_t max)
+{
+    const struct wildseg *s;
+    size_t i, n = 0, start;
+
+    for (s = w->seg; s < w->seg + w->nseg && n < max; s++) {
+	for (i = start = 0; i <= s->n && n < max; i++) {
+	    if (i < s->n && w->tok[s->off + i] < WT_ANY)
+		continue;
+	    if (i - start >= min) {
+		run[n] = (const char *)w->lit + s->off + start;
+		len[n++] = i - start;
+	    }
+	    start = i + 1;
+	}
+    }
+    return n;
+}
+
+/** \return the compiled form of \p p, kept in a small cache so that
+ * callers that match the same few patterns over and over, like
+ * ngmatch(), compile each only once. Do not free the result. */
+/*@observer@*/ const struct wildpat *
+wildpat_cached(const char *p)
+{
+    static struct {
+	/*@null@*/ /*@only@*/ char *p;
+	/*@null@*/ /*@only@*/ struct wildpat *w;
+    } cache[64];
+    unsigned long h = 5381;
+    const char *q;
+    size_t i;
+
+    for (q = p; *q; q++)
+	h = h * 33 + (unsigned char)*q;
+    i = h % (sizeof(cache) / sizeof(cache[0]));
+    if (!cache[i].p || strcmp(cache[i].p, p)) {
+	free(cache[i].p);
+	wildpat_free(cache[i].w);
+	cache[i].p = critstrdup(p, "wildpat_cached");
+	cache[i].w = wildpat_compile(p);
+    }
+    return cache[i].w;
+}
+
 #ifdef	TEST
 #include <stdio.h>
 
@@ -12,9 +12,11 @@
 #include "bsearch_range.h"
 #include "msgid.h"
 #include "sgetcwd.h"
+#include "system.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/uio.h>
 #include <sys/param.h>
@@ -41,8 +43,20 @@
 unsigned long xfirst = 0;
 unsigned long xlast = 0;
 unsigned long xcount = 0;
+unsigned long xovergen = 0;	/* bumped when entries are removed or
+				   reordered, appending keeps it */
 struct xoverinfo *xoverinfo = NULL;
 
+/* xgetxover() keeps the .overview it read as one buffer, and the
+ * xoverinfo[].text of its lines point into it. Only lines built from
+ * article files are malloc()ed separately, xoverheap counts them. */
+static char *xoverarena;
+static size_t xoverarenalen;
+static unsigned long xoverheap;
+
+#define INARENA(t) (xoverarena && (t) >= xoverarena \
+	&& (t) < xoverarena + xoverarenalen)
+
 /* order must match enum xoverfields here! */
 static struct {
     const char *header;
@@ -59,6 +73,81 @@ static struct {
     { "Xref:", 5 }
 };
 
+/* headers added to the overview by the overview_headers option, they
+ * follow Xref in "Name: value" form, see xoverbuild_line() */
+static struct {
+    char *name;			/* without colon */
+    int len;
+} xoverextra[XO_MAXEXTRA];
+int xoverextras = 0;
+
+/** Set the extra overview headers from the whitespace separated list
+ * \a headers, as given to the overview_headers option. */
+void
+xoverextra_set(const char *headers)
+{
+    const char *p = headers;
+    int i;
+
+    for (i = 0; i < xoverextras; i++)
+	free(xoverextra[i].name);
+    xoverextras = 0;
+    while (*p) {
+	size_t len;
+	char *n;
+
+	SKIPLWS(p);
+	len = strcspn(p, " \t");
+	if (!len)
+	    break;
+	n = (char *)critmalloc(len + 2, "xoverextra_set");
+	memcpy(n, p, len);
+	p += len;
+	if (n[len - 1] == ':')
+	    len--;
+	n[len] = ':';
+	n[len + 1] = '\0';
+	if (!len || matchxoverfield(n) != XO_ERR) {
+	    /* builtin fields and duplicates */
+	    ln_log(LNLOG_SWARNING, LNLOG_CTOP,
+		    "overview_headers: ignoring %s", n);
+	    free(n);
+	    continue;
+	}
+	if (xoverextras == XO_MAXEXTRA) {
+	    ln_log(LNLOG_SWARNING, LNLOG_CTOP,
+		    "overview_headers: at most %d headers, ignoring %s",
+		    XO_MAXEXTRA, n);
+	    free(n);
+	    continue;
+	}
+	n[len] = '\0';
+	xoverextra[xoverextras].name = n;
+	xoverextra[xoverextras].len = (int)len;
+	xoverextras++;
+    }
+}
+
+/** \return the name of extra overview header \a k, without colon */
+const char *
+xoverextra_name(int k)
+{
+    return xoverextra[k].name;
+}
+
+static enum xoverfields
+matchxoverextra(const char *header)
+{
+    int i;
+
+    for (i = 0; i < xoverextras; i++) {
+	if (!strncasecmp(header, xoverextra[i].name, xoverextra[i].len)
+		&& header[xoverextra[i].len] == ':')
+	    return (enum xoverfields)(XO_EXTRA + i);
+    }
+    return XO_ERR;
+}
+
 /** match header name -> xover entry
  */
 enum xoverfields matchxoverfield(const char *header)
@@ -73,12 +162,11 @@ enum xoverfields matchxoverfield(const char *header)
     case 'B': f = XO_BYTES;      break;
     case 'L': f = XO_LINES;      break;
     case 'X': f = XO_XREF;       break;
-    default: return XO_ERR;
+    default: return matchxoverextra(header);
     }
     if (!strncasecmp(header, xoverentry[f].header, xoverentry[f].len))
 	return f;
-    else
-	return XO_ERR;
+    return matchxoverextra(header);
 }
 
 /*@null@*/ /*@only@*/ char *
@@ -92,6 +180,163 @@ getxoverfield(char *xoverline, enum xoverfields f)
 
 
 
+/** Prepare \a b to collect overview data from header lines. */
+void
+xoverbuild_init(/*@out@*/ struct xoverbuild *b)
+{
+    int i;
+
+    for (i = 0; i < (int)COUNT_OF(b->field); i++)
+	b->field[i] = NULL;
+    b->cur = NULL;
+    b->curlen = 0;
+    b->cursize = 0;
+    b->curfield = XO_ERR;
+    b->hbytes = -1;
+    b->hlines = -1;
+}
+
+/* take the header collected in b->cur into the overview fields */
+static void
+xoverbuild_flush(struct xoverbuild *b)
+{
+    enum xoverfields f = b->curfield;
+    char *l;
+
+    if (f == XO_ERR)
+	return;
+    b->curfield = XO_ERR;
+    if (f >= XO_EXTRA)
+	l = b->cur + xoverextra[f - XO_EXTRA].len + 1;
+    else
+	l = b->cur + xoverentry[f].len;
+    SKIPLWS(l);
+
+    switch (f) {
+    case XO_BYTES: /* for delaybody */
+	if (!get_long(l, &b->hbytes)) b->hbytes = -1;
+	break;
+    case XO_LINES: /* for delaybody */
+	if (!get_long(l, &b->hlines)) b->hlines = -1;
+	break;
+    case XO_MESSAGEID:
+    case XO_REFERENCES:
+    case XO_XREF:
+	if (!*l)
+	    break;
+	/*@fallthrough@*/
+    default:
+	if (!b->field[f]) {
+	    b->field[f] = critstrdup(l, "xoverbuild");
+	    tab2spc(b->field[f]);
+	    if (f == XO_MESSAGEID)
+		D(d_stop_mid(b->field[f]));
+	}
+    }
+}
+
+/** Feed one header line (without line terminator) into \a b.
+ * Continuation lines of folded headers may be fed as they come. */
+void
+xoverbuild_header(struct xoverbuild *b, const char *line)
+{
+    size_t len = strlen(line);
+
+    if (line[0] != ' ' && line[0] != '\t') {
+	xoverbuild_flush(b);
+	b->curfield = matchxoverfield(line);
+	if (b->curfield == XO_ERR)
+	    return;
+	b->curlen = 0;
+    } else if (b->curfield == XO_ERR) {
+	/* continuation of a header we do not care about */
+	return;
+    }
+
+    if (b->curlen + len + 1 > b->cursize) {
+	b->cursize = b->curlen + len + 1 + 128;
+	b->cur = (char *)critrealloc(b->cur, b->cursize, "xoverbuild");
+    }
+    memcpy(b->cur + b->curlen, line, len + 1);
+    b->curlen += len;
+}
+
+/** Construct an .overview line from the headers fed into \a b, using
+ * \a artno as first field.
+ * \return a malloc()ed .overview line, or NULL if mandatory headers are
+ * missing. */
+/*@null@*/ /*@only@*/ char *
+xoverbuild_line(struct xoverbuild *b,
+	/** first field, article number or file name */
+	const char *artno,
+	/** article size in bytes */
+	long bytes,
+	/** number of body lines */
+	long lines)
+{
+    char *result, *p;
+    char **fl = b->field;
+    size_t extralen = 0;
+    int i;
+
+    xoverbuild_flush(b);
+    if (fl[XO_FROM] == NULL || fl[XO_DATE] == NULL
+	    || fl[XO_SUBJECT] == NULL || fl[XO_MESSAGEID] == NULL || !bytes)
+	return NULL;
+
+    for (i = 0; i < xoverextras; i++) {
+	if (fl[XO_EXTRA + i])
+	    extralen += xoverextra[i].len + strlen(fl[XO_EXTRA + i]);
+	extralen += 3;
+    }
+    result = (char *)critmalloc(strlen(artno) + strlen(fl[XO_SUBJECT])
+				+ strlen(fl[XO_FROM]) + strlen(fl[XO_DATE])
+				+ strlen(fl[XO_MESSAGEID])
+				+ (fl[XO_REFERENCES] ? strlen(fl[XO_REFERENCES]) : 0)
+				+ 100 + (fl[XO_XREF] ? strlen(fl[XO_XREF]) : 0)
+				+ extralen,
+				"computing overview line");
+    p = result + sprintf(result, "%s\t%s\t%s\t%s\t%s\t%s\t%ld\t%ld",
+	    artno, fl[XO_SUBJECT], fl[XO_FROM], fl[XO_DATE],
+	    fl[XO_MESSAGEID],
+	    fl[XO_REFERENCES] ? fl[XO_REFERENCES] : "",
+	    max(b->hbytes, bytes), max(b->hlines, lines));
+    if (fl[XO_XREF]) {
+	p = mastrcpy(p, "\tXref: ");
+	p = mastrcpy(p, fl[XO_XREF]);
+    } else if (xoverextras) {
+	/* keep the position of the extra fields */
+	p = mastrcpy(p, "\t");
+    }
+    for (i = 0; i < xoverextras; i++) {
+	p = mastrcpy(p, "\t");
+	if (fl[XO_EXTRA + i]) {
+	    p = mastrcpy(p, xoverextra[i].name);
+	    p = mastrcpy(p, ": ");
+	    p = mastrcpy(p, fl[XO_EXTRA + i]);
+	}
+    }
+    return result;
+}
+
+/** Release the memory held by \a b. */
+void
+xoverbuild_free(struct xoverbuild *b)
+{
+    int i;
+
+    for (i = 0; i < (int)COUNT_OF(b->field); i++) {
+	if (b->field[i]) {
+	    free(b->field[i]);
+	    b->field[i] = NULL;
+	}
+    }
+    if (b->cur)
+	free(b->cur);
+    b->cur = NULL;
+    b->cursize = b->curlen = 0;
+}
+
 /** Extract information from given file to construct an .overview line.
  *  \return a malloc()ed string .overview */
 /*@null@*/ /*@only@*/
@@ -102,7 +347,7 @@ getxoverline(
 	/** name of article file */
 	const char *const filename)
 {
-    char *l, *block;
+    char *l;
     FILE *f;
     struct stat st;
     struct utimbuf buf;
@@ -127,119 +372,36 @@ getxoverline(
     buf.modtime = st.st_mtime;
 
     if ((f = fopen(filename, "r"))) {
-	char *from, *subject, *date, *msgid, *references, *xref;
-	long bytes, linecount;
-	long hbytes = -1, hlines = -1; /* from header */
-
-	from = NULL;
-	subject = NULL;
-	date = NULL;
-	msgid = NULL;
-	references = NULL;
-	xref = NULL;
-	linecount = 0;
-	bytes = st.st_size;
-
-	while ((l = block = getfoldedline(f))) {
-	    enum xoverfields field;
+	struct xoverbuild xob;
+	long linecount = 0;
+
+	xoverbuild_init(&xob);
+	while ((l = getfoldedline(f))) {
 	    if (!*l) {
-		free(block);
+		free(l);
 		break;
 	    }
-	    field = matchxoverfield(l);
-	    if (field == XO_ERR) {
-		free(block);
-		continue;
-	    }
-	    l += xoverentry[field].len;
-	    SKIPLWS(l);
-
-	    switch (field) {
-	    case XO_FROM:
-		if (!from) {
-		    from = critstrdup(l, "getxoverline");
-		    tab2spc(from);
-		}
-		break;
-	    case XO_SUBJECT:
-		if (!subject) {
-		    subject = critstrdup(l, "getxoverline");
-		    tab2spc(subject);
-		}
-		break;
-	    case XO_DATE:
-		if (!date) {
-		    date = critstrdup(l, "getxoverline");
-		    tab2spc(date);
-		}
-		break;
-	    case XO_MESSAGEID:
-		if (!msgid && *l) {
-		    msgid = critstrdup(l, "getxoverline");
-		    tab2spc(msgid);
-		    D(d_stop_mid(msgid));
-		}
-		break;
-	    case XO_REFERENCES:
-		if (!references && *l) {
-		    references = critstrdup(l, "getxoverline");
-		    tab2spc(references);
-		}
-		break;
-	    case XO_BYTES: /* for delaybody */
-		if (!get_long(l, &hbytes)) hbytes=-1;
-		break;
-	    case XO_LINES: /* for delaybody */
-		if (!get_long(l, &hlines)) hlines=-1;
-		break;
-	    case XO_XREF:
-		if (!xref && *l) {
-		    xref = critstrdup(l, "getxoverline");
-		    tab2spc(xref);
-		}
-	    default:
-		;
-	    }
-	    free(block);
+	    xoverbuild_header(&xob, l);
+	    free(l);
 	}
 
 	while ((l = getaline(f))) {
 	    linecount++;
 	}
 
-	if (from != NULL && date != NULL && subject != NULL && msgid != NULL
-	    && bytes) {
-	    if (!require_messageidlink || ihave(msgid)) {
-		char *p;
-		/* only generate message ID if article has a link in
-		   message.id */
-		result = (char *)critmalloc(strlen(filename) + strlen(subject) + strlen(from) +
-					    strlen(date) + strlen(msgid) +
-					    (references ? strlen(references) : 0)
-					    + 100 + (xref ? strlen(xref) : 0),
-					    "computing overview line");
-		p = result + sprintf(result, "%s\t%s\t%s\t%s\t%s\t%s\t%ld\t%ld",
-			filename, subject, from, date, msgid,
-			references ? references : "", max(hbytes,bytes), max(hlines,linecount));
-		if (xref) {
-		    p = mastrcpy(p, "\tXref: ");
-		    (void)mastrcpy(p, xref);
-		}
-	    }
-	}			/* FIXME: if mandatory headers missing, delete offending article */
+	/* only generate message ID if article has a link in
+	   message.id; building the line flushes the last header into
+	   xob.field[] */
+	result = xoverbuild_line(&xob, filename, (long)st.st_size,
+		linecount);
+	if (result && require_messageidlink
+		&& !ihave(xob.field[XO_MESSAGEID])) {
+	    free(result);
+	    result = NULL;
+	}
+	/* FIXME: if mandatory headers missing, delete offending article */
 	fclose(f);
-	if (from)
-	    free(from);
-	if (date)
-	    free(date);
-	if (subject)
-	    free(subject);
-	if (msgid)
-	    free(msgid);
-	if (references)
-	    free(references);
-	if (xref)
-	    free(xref);
+	xoverbuild_free(&xob);
     }
     /* restore atime */
     utime(filename, &buf);
@@ -258,6 +420,593 @@ _compxover(const void *a, const void *b)
     return (la->artno > lb->artno) - (la->artno < lb->artno);
 }
 
+/*
+ * .overview.index -- binary index of .overview
+ *
+ * nntpd maps .overview and this index instead of copying every line
+ * into xoverinfo, so GROUP costs the same for large and small groups
+ * and XOVER/HDR only touch the pages of the lines they print. The
+ * index has a header followed by one entry per .overview line, sorted
+ * by article number. It covers the first ovsize bytes of .overview;
+ * lines that store appended since are parsed from the mapped tail.
+ *
+ * The index also omits the articles listed in the first delsize bytes
+ * of .overview.deleted, so that the nntpd processes reading a group
+ * share the work of applying cancels along with the mapped pages.
+ * Whichever process merges new lines or cancels writes a new index;
+ * texpire and xgetxover() replace .overview, which changes its inode
+ * and invalidates the index.
+ */
+#define XOIDX_MAGIC "LNXOIDX2"
+#define XOIDX_TAILMAX 256	/* rewrite the index beyond this many tail lines */
+#define XOIDX_DELETED UINT32_MAX	/* len of entries being removed */
+
+struct xoidxhead {
+    char magic[8];
+    uint64_t ovsize;		/* bytes of .overview indexed */
+    uint64_t ovino;		/* inode number of .overview */
+    uint64_t count;		/* number of entries that follow */
+    uint64_t delino;		/* inode number of .overview.deleted */
+    uint64_t delsize;		/* bytes of .overview.deleted applied */
+};
+
+struct xoidxent {
+    uint64_t off;		/* offset of the line in .overview */
+    uint32_t artno;
+    uint32_t len;		/* length of the line without newline */
+};
+
+static struct {
+    int active;			/* xoverinfo is unused, see xoverline() */
+    /*@null@*/ char *ov;	/* mapped .overview */
+    size_t ovlen;
+    /*@null@*/ void *map;	/* mapped .overview.index */
+    size_t maplen;
+    /*@null@*/ const struct xoidxent *ent;	/* entries in map */
+    unsigned long nent;
+    /*@null@*/ struct xoidxent *tail;	/* entries not in the index file */
+    unsigned long ntail;
+    unsigned long tailsize;	/* allocated entries in tail */
+    size_t parsed;		/* end of the last line in tail */
+    dev_t dirdev;		/* group directory */
+    ino_t dirino;
+    dev_t dev;			/* .overview when it was last looked at */
+    ino_t ino;
+    time_t mtime;
+    ino_t delino;		/* .overview.deleted */
+    off_t delsize;		/* bytes of it applied */
+} xom;
+
+static void xoverdense_reset(void);
+
+static int
+_compxoidx(const void *a, const void *b)
+{
+    const struct xoidxent *la = (const struct xoidxent *)a;
+    const struct xoidxent *lb = (const struct xoidxent *)b;
+
+    if (la->artno != lb->artno)
+	return (la->artno > lb->artno) - (la->artno < lb->artno);
+    return (la->off > lb->off) - (la->off < lb->off);
+}
+
+/*@dependent@*/ static const struct xoidxent *
+xoidx_ent(unsigned long i)
+{
+    return i < xom.nent ? &xom.ent[i] : &xom.tail[i - xom.nent];
+}
+
+static void
+xoidx_unmapindex(void)
+{
+    if (xom.map)
+	(void)munmap(xom.map, xom.maplen);
+    xom.map = NULL;
+    xom.ent = NULL;
+    xom.nent = 0;
+}
+
+/** map .overview.index if it belongs to the mapped .overview with
+ * inode \p ino and the current .overview.deleted.
+ * \return number of .overview bytes it covers, 0 if none */
+static size_t
+xoidx_mapindex(ino_t ino)
+{
+    struct xoidxhead h;
+    struct stat st, del;
+    const struct xoidxent *last;
+    int fd;
+
+    if ((fd = open(".overview.index", O_RDONLY)) < 0)
+	return 0;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(h)
+	    || read(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)
+	    || memcmp(h.magic, XOIDX_MAGIC, sizeof(h.magic))
+	    || h.ovino != (uint64_t)ino || h.ovsize > xom.ovlen
+	    || (uint64_t)st.st_size != sizeof(h) + h.count * sizeof(struct xoidxent)
+	    || (h.ovsize && xom.ov[h.ovsize - 1] != '\n')
+	    || (h.delsize && (stat(".overview.deleted", &del)
+		    || h.delino != (uint64_t)del.st_ino
+		    || h.delsize > (uint64_t)del.st_size))) {
+	(void)close(fd);
+	return 0;
+    }
+    xom.maplen = (size_t)st.st_size;
+    xom.map = mmap(NULL, xom.maplen, PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (xom.map == MAP_FAILED) {
+	xom.map = NULL;
+	return 0;
+    }
+    xom.ent = (const struct xoidxent *)((char *)xom.map + sizeof(h));
+    xom.nent = (unsigned long)h.count;
+    /* a recycled inode number can make a stale index look current,
+     * check that the last entry points to its line */
+    if (xom.nent) {
+	last = &xom.ent[xom.nent - 1];
+	if (last->off + last->len >= h.ovsize
+		|| strtoul(xom.ov + last->off, NULL, 10) != last->artno) {
+	    xoidx_unmapindex();
+	    return 0;
+	}
+    }
+    xom.delino = (ino_t)h.delino;
+    xom.delsize = (off_t)h.delsize;
+    return (size_t)h.ovsize;
+}
+
+/** parse the .overview lines from \p start on into xom.tail.
+ * \return 0 if they are not in ascending order after the index,
+ * -1 if an article number does not fit into the index */
+static int
+xoidx_parsetail(size_t start)
+{
+    unsigned long max = 0;
+    const char *p = xom.ov + start, *end = xom.ov + xom.ovlen, *q;
+    int sorted = 1;
+
+    if (xom.nent + xom.ntail)
+	max = xoidx_ent(xom.nent + xom.ntail - 1)->artno;
+    xom.parsed = start;
+    while (p < end && (q = (const char *)memchr(p, '\n', (size_t)(end - p)))) {
+	unsigned long art;
+	char *tmp;
+
+	while (p < q && (*p == ' ' || *p == '\t'))
+	    p++;
+	art = strtoul(p, &tmp, 10);
+	/* same test as xgetxover() */
+	if (art && tmp < q) {
+	    if (art > 0xffffffffUL)
+		return -1;
+	    if (xom.ntail == xom.tailsize) {
+		xom.tailsize = xom.tailsize ? 2 * xom.tailsize : 64;
+		xom.tail = (struct xoidxent *)critrealloc((char *)xom.tail,
+			xom.tailsize * sizeof(struct xoidxent),
+			"xoidx_parsetail");
+	    }
+	    xom.tail[xom.ntail].off = (uint64_t)(p - xom.ov);
+	    xom.tail[xom.ntail].artno = (uint32_t)art;
+	    xom.tail[xom.ntail].len = (uint32_t)(q - p);
+	    xom.ntail++;
+	    if (art <= max)
+		sorted = 0;
+	    max = art;
+	}
+	p = q + 1;
+	xom.parsed = (size_t)(p - xom.ov);
+    }
+    return sorted;
+}
+
+/** copy the entries of the index file into xom.tail, keeping their
+ * order, so that they can be modified */
+static void
+xoidx_materialize(void)
+{
+    unsigned long n = xom.nent + xom.ntail;
+
+    if (!xom.nent)
+	return;
+    xom.tail = (struct xoidxent *)critrealloc((char *)xom.tail,
+	    (n + 1) * sizeof(struct xoidxent), "xoidx_materialize");
+    memmove(xom.tail + xom.nent, xom.tail, xom.ntail * sizeof(struct xoidxent));
+    memcpy(xom.tail, xom.ent, xom.nent * sizeof(struct xoidxent));
+    xom.ntail = n;
+    xom.tailsize = n + 1;
+    xoidx_unmapindex();
+}
+
+/** update xcount and the water marks after entries were added or
+ * removed */
+static void
+xoidx_setcount(void)
+{
+    xcount = xom.nent + xom.ntail;
+    if (xcount) {
+	xfirst = xoidx_ent(0)->artno;
+	xlast = xoidx_ent(xcount - 1)->artno;
+    } else {
+	xfirst = ULONG_MAX;
+	xlast = 0;
+    }
+    xoverdense_reset();
+}
+
+/** remove the articles that were added to .overview.deleted since we
+ * last looked at it.
+ * \return 0 if the file was replaced and everything must be reloaded */
+static int
+xoidx_deleted(void)
+{
+    struct stat st;
+    FILE *f;
+    char buf[32], *pp;
+    unsigned long i, j, uu, n = 0;
+    long k;
+
+    if (stat(".overview.deleted", &st))
+	return errno == ENOENT && xom.delsize == 0;
+    if (xom.delsize && (st.st_ino != xom.delino || st.st_size < xom.delsize))
+	return 0;
+    xom.delino = st.st_ino;
+    if (st.st_size == xom.delsize)
+	return 1;
+    if (!(f = fopen(".overview.deleted", "r"))
+	    || fseeko(f, xom.delsize, SEEK_SET)) {
+	ln_log(LNLOG_SERR, LNLOG_CGROUP, "Cannot read .overview.deleted: %m");
+	if (f)
+	    (void)fclose(f);
+	return 0;
+    }
+    while (fgets(buf, sizeof(buf), f) == buf
+	    && (pp = strchr(buf, '\n')) /* want only complete lines */) {
+	xom.delsize += pp - buf + 1;
+	*pp = '\0';
+	if (get_ulong(buf, &uu) && (k = findxover(uu)) >= 0) {
+	    if (!n++)
+		xoidx_materialize();
+	    /* findxover() finds the first of duplicate lines */
+	    while ((unsigned long)k + 1 < xom.ntail
+		    && xom.tail[k].len == XOIDX_DELETED
+		    && xom.tail[k + 1].artno == uu)
+		k++;
+	    xom.tail[k].len = XOIDX_DELETED;
+	}
+    }
+    (void)fclose(f);
+    if (n) {
+	for (i = j = 0; i < xom.ntail; i++) {
+	    if (xom.tail[i].len != XOIDX_DELETED)
+		xom.tail[j++] = xom.tail[i];
+	}
+	xom.ntail = j;
+	xoidx_setcount();
+	xovergen++;
+    }
+    return 1;
+}
+
+/** bring the overview mapped before up to date if it belongs to the
+ * current directory and store only appended lines to .overview since.
+ * \return 0 if it must be reloaded */
+static int
+xoidx_refresh(void)
+{
+    struct stat st;
+    char *ov;
+    int fd;
+
+    if (stat(".", &st) || st.st_dev != xom.dirdev || st.st_ino != xom.dirino)
+	return 0;
+    if ((fd = open(".overview", O_RDONLY)) < 0)
+	return 0;
+    if (fstat(fd, &st) || st.st_dev != xom.dev || st.st_ino != xom.ino
+	    || (size_t)st.st_size < xom.ovlen
+	    || ((size_t)st.st_size == xom.ovlen && st.st_mtime != xom.mtime)) {
+	(void)close(fd);
+	return 0;
+    }
+    if ((size_t)st.st_size > xom.ovlen) {
+	ov = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+		fd, 0);
+	if (ov == MAP_FAILED) {
+	    (void)close(fd);
+	    return 0;
+	}
+	(void)munmap(xom.ov, xom.ovlen);
+	xom.ov = ov;
+	xom.ovlen = (size_t)st.st_size;
+	if (xoidx_parsetail(xom.parsed) != 1) {
+	    (void)close(fd);
+	    return 0;
+	}
+	xoidx_setcount();
+    }
+    (void)close(fd);
+    xom.mtime = st.st_mtime;
+    return xoidx_deleted();
+}
+
+/** write \p n entries \p e covering \p ovsize bytes of the .overview
+ * with inode \p ino and \p delsize bytes of the .overview.deleted with
+ * inode \p delino to .overview.index. Failure is not an error, nntpd
+ * may lack write permission. */
+static void
+xoidx_write(const struct xoidxent *e, unsigned long n, size_t ovsize,
+	ino_t ino, ino_t delino, off_t delsize)
+{
+    char newfile[] = ".overview.index.XXXXXX";
+    struct xoidxhead h;
+    FILE *w;
+    int wfd;
+
+    if ((wfd = mkstemp(newfile)) == -1) {
+	ln_log(LNLOG_SDEBUG, LNLOG_CGROUP,
+		"cannot create new .overview.index: %m");
+	return;
+    }
+    if (!(w = fdopen(wfd, "w"))) {
+	(void)close(wfd);
+	(void)unlink(newfile);
+	return;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, XOIDX_MAGIC, sizeof(h.magic));
+    h.ovsize = ovsize;
+    h.ovino = (uint64_t)ino;
+    h.count = n;
+    h.delino = (uint64_t)delino;
+    h.delsize = (uint64_t)delsize;
+    (void)fchmod(wfd, (mode_t)0660);
+    if (fwrite(&h, sizeof(h), 1, w) != 1
+	    || (n && fwrite(e, sizeof(*e), n, w) != n)
+	    || fclose(w)
+	    || rename(newfile, ".overview.index")) {
+	ln_log(LNLOG_SERR, LNLOG_CGROUP,
+		"cannot write %s/.overview.index: %m", sgetcwd());
+	(void)unlink(newfile);
+    }
+}
+
+/**
+ * Map .overview and its index instead of reading them into
+ * xoverinfo. Use xoverartno() and xoverline() to access the result.
+ * If the overview of the current directory is mapped already, only
+ * lines appended since and new entries in .overview.deleted are read.
+ * The index is rebuilt if it is missing, stale or too many lines have
+ * been appended since it was written.
+ * \return 0 problem, 1 success
+ */
+int
+xmapxover(/** if set, update count of this group */
+	/*@null@*/ struct newsgroup *g)
+{
+    struct stat st, dir;
+    size_t covered;
+    int fd, sorted;
+
+    if (!xom.active || !xoidx_refresh()) {
+	freexover();
+	if (stat(".", &dir) || (fd = open(".overview", O_RDONLY)) < 0)
+	    return xgetxover(0, g, 0);
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+	    (void)close(fd);
+	    return xgetxover(0, g, 0);
+	}
+	xom.ovlen = (size_t)st.st_size;
+	xom.ov = (char *)mmap(NULL, xom.ovlen, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (xom.ov == MAP_FAILED) {
+	    xom.ov = NULL;
+	    return xgetxover(0, g, 0);
+	}
+	xom.active = 1;
+	xom.dirdev = dir.st_dev;
+	xom.dirino = dir.st_ino;
+	xom.dev = st.st_dev;
+	xom.ino = st.st_ino;
+	xom.mtime = st.st_mtime;
+
+	covered = xoidx_mapindex(st.st_ino);
+	if ((sorted = xoidx_parsetail(covered)) < 0) {
+	    freexover();
+	    return xgetxover(0, g, 0);
+	}
+	if (!sorted) {
+	    xoidx_materialize();
+	    ln_sort(xom.tail, xom.ntail, sizeof(struct xoidxent), _compxoidx);
+	}
+	xoidx_setcount();
+	if (!xoidx_deleted()) {
+	    freexover();
+	    return xgetxover(0, g, 0);
+	}
+	if (xom.ntail > XOIDX_TAILMAX || (!xom.map && xom.ntail)) {
+	    /* we merged lines or applied cancels in memory,
+	     * save the result for the other readers */
+	    xoidx_materialize();
+	    xoidx_write(xom.tail, xom.ntail, xom.parsed, st.st_ino,
+		    xom.delino, xom.delsize);
+	}
+    }
+
+    if (g) {
+	g->count = xcount;
+	if (xom.delsize && xcount && g->first < xfirst)
+	    g->first = xfirst;
+    }
+    return 1;
+}
+
+/** \return the article number of overview entry \p i */
+unsigned long
+xoverartno(unsigned long i)
+{
+    return xom.active ? xoidx_ent(i)->artno : xoverinfo[i].artno;
+}
+
+/** \return the text of overview entry \p i, without newline and
+ * not NUL-terminated, with its length in *\p len, or NULL */
+/*@null@*/ /*@dependent@*/ const char *
+xoverline(unsigned long i, /*@out@*/ size_t *len)
+{
+    const struct xoidxent *e;
+
+    if (!xom.active) {
+	if (!xoverinfo[i].text)
+	    return NULL;
+	*len = strlen(xoverinfo[i].text);
+	return xoverinfo[i].text;
+    }
+    e = xoidx_ent(i);
+    if (e->off + e->len > xom.ovlen)
+	return NULL;
+    *len = e->len;
+    return xom.ov + e->off;
+}
+
+/** Like getxoverfield(), but for overview entry \p i, and without
+ * copying: HDR and XOVER stream the result to the client.
+ * \return the start of field \p f, not NUL-terminated, with its
+ * length in *\p len, or NULL if the entry has no such field */
+/*@null@*/ /*@dependent@*/ const char *
+xoverfield(unsigned long i, enum xoverfields f, /*@out@*/ size_t *len)
+{
+    const char *p, *end, *q;
+    size_t linelen;
+    int n;
+
+    if (f == XO_ERR || f == XO_ARTNO || !(p = xoverline(i, &linelen)))
+	return NULL;
+    end = p + linelen;
+    for (n = (int)f; n > 0; n--) {
+	if (!(p = (const char *)memchr(p, '\t', (size_t)(end - p))))
+	    return NULL;
+	p++;
+    }
+    if (!(q = (const char *)memchr(p, '\t', (size_t)(end - p))))
+	q = end;
+    *len = (size_t)(q - p);
+    return p;
+}
+
+/** Find the value of header \p f in overview entry \p i, without the
+ * "Name: " prefix of Xref and the overview_headers fields.
+ * \return 1 with the value in *\p val and *\p len, 0 if the article
+ * does not have the header, -1 if the overview line does not tell:
+ * it was written before the header was added to overview_headers */
+int
+xoverheader(unsigned long i, enum xoverfields f,
+	/*@out@*/ const char **val, /*@out@*/ size_t *len)
+{
+    const char *t = xoverfield(i, f, len);
+    size_t n;
+
+    if (f < XO_EXTRA) {
+	if (!t || (f == XO_XREF && !*len))
+	    return 0;
+	if (f == XO_XREF && *len >= 6) {
+	    t += 6;		/* cut out 'Xref: ' */
+	    *len -= 6;
+	}
+	*val = t;
+	return 1;
+    }
+    if (!t)
+	return -1;
+    if (!*len)
+	return 0;
+    n = (size_t)xoverextra[f - XO_EXTRA].len;
+    if (*len <= n || t[n] != ':'
+	    || strncasecmp(t, xoverextra[f - XO_EXTRA].name, n))
+	return -1;
+    for (t += n + 1, *len -= n + 1; *len && *t == ' '; t++, (*len)--)
+	;
+    *val = t;
+    return 1;
+}
+
+/** first entry with artno >= \p art in the mapped overview */
+static unsigned long
+xoidx_lower(unsigned long art)
+{
+    unsigned long lo = 0, hi = xcount;
+
+    while (lo < hi) {
+	unsigned long mid = lo + (hi - lo) / 2;
+
+	if (xoidx_ent(mid)->artno < art)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * findxover() maps article numbers to overview indices through a table
+ * indexed by artno - xoverdensebase while the group is dense enough,
+ * and falls back to bsearch() otherwise. The table is built on first
+ * use after the overview data changed.
+ */
+#define XOVERDENSE_NONE UINT32_MAX
+#define XOVERDENSE_SLACK 1024	/* tolerated gaps beyond one per article */
+
+static uint32_t *xoverdense;
+static unsigned long xoverdensebase;
+static unsigned long xoverdenselen;
+static int xoverdensevalid;	/* xoverdense (or its absence) is current */
+
+static void
+xoverdense_reset(void)
+{
+    if (xoverdense)
+	free(xoverdense);
+    xoverdense = NULL;
+    xoverdenselen = 0;
+    xoverdensevalid = 0;
+}
+
+static void
+xoverdense_build(void)
+{
+    unsigned long i, art, lo = ULONG_MAX, hi = 0;
+
+    xoverdensevalid = 1;
+    for (i = 0; i < xcount; i++) {
+	art = xoverartno(i);
+	if (art < lo)
+	    lo = art;
+	if (art > hi)
+	    hi = art;
+    }
+    if (xcount == 0 || xcount >= XOVERDENSE_NONE
+	    || hi - lo >= 2 * xcount + XOVERDENSE_SLACK) {
+	if ((debugmode & DEBUG_XOVER) && !xom.active) {
+	    /* bsearch() needs ascending order */
+	    for (i = 0; i + 1 < xcount; i++) {
+		if (xoverinfo[i].artno > xoverinfo[i + 1].artno) {
+		    ln_log(LNLOG_SERR, LNLOG_CTOP,
+			   "problem in findxover: xoverinfo[%lu] and [%lu] "
+			   "not in ascending order: %lu > %lu, aborting",
+			   i, i + 1, xoverinfo[i].artno, xoverinfo[i + 1].artno);
+		    abort();	/* bail out */
+		}
+	    }
+	}
+	return;
+    }
+    xoverdensebase = lo;
+    xoverdenselen = hi - lo + 1;
+    xoverdense = (uint32_t *)critmalloc(xoverdenselen * sizeof(uint32_t),
+	    "xoverdense_build");
+    memset(xoverdense, 0xff, xoverdenselen * sizeof(uint32_t));
+    /* backwards, so the first of duplicate entries wins */
+    for (i = xcount; i-- > 0;)
+	xoverdense[xoverartno(i) - lo] = (uint32_t)i;
+}
+
 /*
  * return xover record of "article". -1 means failure.
  */
@@ -268,20 +1017,23 @@ findxover(unsigned long article)
 
     if (xcount == 0)
 	return -1;
-    xoi.artno = article;
+    if (!xoverdensevalid)
+	xoverdense_build();
+    if (xoverdense) {
+	uint32_t i;
+
+	if (article < xoverdensebase
+		|| article - xoverdensebase >= xoverdenselen)
+	    return -1;
+	i = xoverdense[article - xoverdensebase];
+	return i == XOVERDENSE_NONE ? -1 : (long)i;
+    }
+    if (xom.active) {
+	unsigned long i = xoidx_lower(article);
 
-    if (debugmode & DEBUG_XOVER) {	/* check ordering */
-	unsigned i;
-	for (i = 0; i < xcount - 1; i++) {
-	    if (xoverinfo[i].artno > xoverinfo[i + 1].artno) {
-		ln_log(LNLOG_SERR, LNLOG_CTOP,
-		       "problem in findxover: xoverinfo[%u] and [%u] "
-		       "not in ascending order: %lu > %lu, aborting",
-		       i, i + 1, xoverinfo[i].artno, xoverinfo[i + 1].artno);
-		abort();	/* bail out */
-	    }
-	}
+	return (i < xcount && xoidx_ent(i)->artno == article) ? (long)i : -1;
     }
+    xoi.artno = article;
 
     fnd = (struct xoverinfo *)bsearch(&xoi, xoverinfo,
 				      xcount, sizeof(struct xoverinfo),
@@ -307,6 +1059,16 @@ findxoverrange(unsigned long low, unsigned long high,
 
     if (xcount == 0 || low > high)
 	return -1;
+    if (xom.active) {
+	unsigned long l = xoidx_lower(low);
+	unsigned long h = high == ULONG_MAX ? xcount : xoidx_lower(high + 1);
+
+	if (l >= h)
+	    return -1;
+	*idxlow = (long)l;
+	*idxhigh = (long)h - 1;
+	return 0;
+    }
 
     xl.artno = low;
     xh.artno = high;
@@ -327,8 +1089,10 @@ crunchxover(struct xoverinfo *xi, unsigned long count, const int refval)
     i = j = 0;
     while (j < count) {
 	while (j < count && xi[j].exists == refval) {
-	    if (xi[j].text)
+	    if (xi[j].text && !INARENA(xi[j].text)) {
 		free(xi[j].text);
+		xoverheap--;
+	    }
 	    j++;
 	}
 	if (j >= count)
@@ -392,6 +1156,8 @@ xgetxover(
 		overview = NULL;
 	    } else {
 		overview[st.st_size] = '\0';
+		xoverarena = overview;
+		xoverarenalen = (size_t)st.st_size + 1;
 	    }
 	}
 	close(fd);
@@ -415,7 +1181,7 @@ xgetxover(
     if (fixxover) {
 	dl = dirlist(".", DIRLIST_ALLNUM, &xcount);
 	if (!dl) {
-	    free(overview);
+	    freexover();
 	    return 0;
 	}
 
@@ -454,8 +1220,7 @@ xgetxover(
 	    if (fixxover && (art > xlast || art < xfirst)) {
 		update = 1;
 	    } else {
-		char *tmp2 = critstrdup(p, "getxover");
-		xoverinfo[current].text = tmp2;
+		xoverinfo[current].text = p;
 		xoverinfo[current].exists = 0;
 		xoverinfo[current].artno = art;
 		current++;
@@ -467,6 +1232,7 @@ xgetxover(
     }
 
     xcount = current;		/* to prevent findxover from choking */
+    xoverdense_reset();
 
     /* read .overview.deleted file and erase entries
      * NOTE: this assumes that the article is REALLY gone so it isn't
@@ -492,6 +1258,7 @@ xgetxover(
 	    ln_log(LNLOG_SERR, LNLOG_CGROUP, "Cannot read .overview.deleted: %m");
 	(void)fclose(ii);
 	xcount = current = crunchxover(xoverinfo, current, -1);
+	xoverdense_reset();
 	if (g && g->first < xoverinfo[0].artno)
 	    g->first = xoverinfo[0].artno;
     }
@@ -499,7 +1266,6 @@ xgetxover(
     if (!fixxover) {
 	if (g)
 	    g->count = current;
-	free(overview);
 	return 1;
     }
 
@@ -525,6 +1291,7 @@ xgetxover(
 
 	/* enter new xover line into database */
 	if ((xoverinfo[current].text = getxoverline(require_messageidlink, *t))) {
+	    xoverheap++;
 	    xoverinfo[current].exists = 1;
 	    xoverinfo[current].artno = art;
 	    update = 1;
@@ -555,8 +1322,6 @@ xgetxover(
 
     if (dl)
 	free_dirlist(dl);
-    if (overview)
-	free(overview);
 
     /* look for removed articles */
     if (!update) {
@@ -583,6 +1348,7 @@ xgetxover(
 
     /* sort xover */
     xcount = current;
+    xoverdense_reset();
 
     if (update)
 	writexover();
@@ -605,7 +1371,10 @@ writexover(void)
 {
     char newfile[] = ".overview.XXXXXX";
     int wfd, err = 0;
-    unsigned long art;
+    unsigned long art, n = 0;
+    uint64_t off = 0;
+    struct xoidxent *e;
+    struct stat st;
     FILE *w;
 
     if ((wfd = mkstemp(newfile)) == -1) {
@@ -619,14 +1388,28 @@ writexover(void)
 	return -1;
     }
 
+    e = (struct xoidxent *)critmalloc((xcount + 1) * sizeof(*e), "writexover");
     clearerr(w);
     for (art = 0; art < xcount; art++) {
 	if (xoverinfo[art].exists && xoverinfo[art].text) {
+	    size_t len = strlen(xoverinfo[art].text);
+
 	    if ((EOF == fputs(xoverinfo[art].text, w))
 		|| (EOF == fputs("\n", w))) {
 		err = 1;
 		break;
 	    }
+	    if (e && xoverinfo[art].artno <= 0xffffffffUL) {
+		e[n].off = off;
+		e[n].artno = (uint32_t)xoverinfo[art].artno;
+		e[n].len = (uint32_t)len;
+		n++;
+	    } else if (e) {
+		/* article numbers this large cannot be indexed */
+		free(e);
+		e = NULL;
+	    }
+	    off += len + 1;
 	}
     }
 
@@ -634,18 +1417,32 @@ writexover(void)
 	err = 1;
     }
 
+    if (fstat(wfd, &st)) {
+	err = 1;
+    }
+
     if (fclose(w)) {
 	ln_log(LNLOG_SERR, LNLOG_CGROUP, "Cannot write new .overview file: %m");
 	err = 1;
     }
 
     if (!err) {
+	/* the old index must not survive if writing the new one fails */
+	(void)log_unlink(".overview.index", 1);
 	if (log_rename(newfile, ".overview"))
 	    err = 1;
 	else
 	    (void)log_unlink(".overview.deleted", 1);
     }
 
+    if (e) {
+	if (!err) {
+	    ln_sort(e, n, sizeof(*e), _compxoidx);
+	    xoidx_write(e, n, (size_t)off, st.st_ino, 0, 0);
+	}
+	free(e);
+    }
+
     if (!err) {
 	char s[LN_PATH_MAX];
 	ln_log(LNLOG_SDEBUG, LNLOG_CGROUP,
@@ -660,14 +1457,33 @@ writexover(void)
 void
 freexover(void)
 {
+    xoverdense_reset();
+    xovergen++;
+    if (xom.active) {
+	xoidx_unmapindex();
+	if (xom.ov)
+	    (void)munmap(xom.ov, xom.ovlen);
+	xom.ov = NULL;
+	xom.ovlen = 0;
+	if (xom.tail)
+	    free(xom.tail);
+	memset(&xom, 0, sizeof(xom));
+    }
     if (xoverinfo) {
 	long unsigned i;
-	for (i = 0; i < xcount; i++) {
-	    if (xoverinfo[i].text)
+	for (i = 0; xoverheap && i < xcount; i++) {
+	    if (xoverinfo[i].text && !INARENA(xoverinfo[i].text)) {
 		free(xoverinfo[i].text);
+		xoverheap--;
+	    }
 	}
 	free(xoverinfo);
 	xoverinfo = 0;
     }
+    if (xoverarena)
+	free(xoverarena);
+    xoverarena = NULL;
+    xoverarenalen = 0;
+    xoverheap = 0;
     xcount = 0;
 }
@@ -0,0 +1,288 @@
+/** \file xpatindex.c
+ * In-memory trigram index for XPAT on overview fields.
+ *
+ * Threading newsreaders look for the followups of an article with
+ * "XPAT References <range> *<mid>*" over the whole group, which used to
+ * match every overview line each time. For Subject, From, Message-ID
+ * and References nntpd keeps, per field, the list of overview entries
+ * that contain each trigram (three consecutive bytes) of the field,
+ * hashed into XPI_BUCKETS lists. Every text a pattern matches contains
+ * the trigrams of the pattern's literal runs, so intersecting their
+ * lists yields the candidates, which are then checked with the real
+ * matcher. Hash collisions only add candidates, they never lose one.
+ *
+ * An index is built on the first XPAT for its field in a group with at
+ * least xpat_index articles. Entries that store appended to .overview
+ * since are added on the next XPAT, see xmapxover(); the index is
+ * dropped when xovergen says that entries were removed or reordered.
+ *
+ * See AUTHORS for copyright holders and contributors.
+ * See README for restrictions on the use of this software.
+ */
+
+#include "leafnode.h"
+#include "critmem.h"
+#include "xpatindex.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_DMALLOC
+#include <dmalloc.h>
+#endif
+
+#define XPI_BUCKETS 65536	/* lists per field, a power of two */
+#define XPI_MAXRUNS 32		/* literal runs used per pattern */
+#define XPI_MAXLISTS 16		/* lists intersected per pattern */
+
+/** entries that contain one trigram hash, as deltas in 7-bit groups */
+struct xpilist {
+    unsigned char *buf;
+    size_t len;
+    size_t size;
+    unsigned long last;		/* last entry added plus one, 0 if none */
+};
+
+static const enum xoverfields xpifield[] = {
+    XO_SUBJECT, XO_FROM, XO_MESSAGEID, XO_REFERENCES
+};
+#define XPI_FIELDS (sizeof(xpifield) / sizeof(xpifield[0]))
+
+static struct {
+    /*@null@*/ /*@only@*/ struct xpilist *list;	/* XPI_BUCKETS lists */
+    unsigned long gen;		/* xovergen of the entries */
+    unsigned long n;		/* entries indexed */
+} xpi[XPI_FIELDS];
+
+/* candidates returned by xpatindex_find() and scratch space */
+static unsigned long *cand, *tmp;
+static unsigned long candsize, tmpsize;
+
+static unsigned int
+xpi_hash(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    unsigned long t = (unsigned long)u[0] << 16 | u[1] << 8 | u[2];
+
+    return (unsigned int)(((t * 2654435761UL) & 0xffffffffUL) >> 16)
+	& (XPI_BUCKETS - 1);
+}
+
+static void
+xpi_free(unsigned int k)
+{
+    unsigned int b;
+
+    if (!xpi[k].list)
+	return;
+    for (b = 0; b < XPI_BUCKETS; b++)
+	free(xpi[k].list[b].buf);
+    free(xpi[k].list);
+    xpi[k].list = NULL;
+}
+
+static void
+xpi_add(struct xpilist *l, unsigned long i)
+{
+    unsigned long d;
+
+    if (l->last == i + 1)
+	return;			/* trigram occurs twice in this field */
+    d = i + 1 - l->last;
+    l->last = i + 1;
+    if (l->len + 10 > l->size) {
+	l->size = l->size ? 2 * l->size : 16;
+	l->buf = (unsigned char *)critrealloc((char *)l->buf, l->size,
+		"xpi_add");
+    }
+    while (d >= 0x80) {
+	l->buf[l->len++] = (unsigned char)(d | 0x80);
+	d >>= 7;
+    }
+    l->buf[l->len++] = (unsigned char)d;
+}
+
+/* decode the list entry at *p, advance *p and *prev */
+static unsigned long
+xpi_next(const unsigned char **p, unsigned long *prev)
+{
+    unsigned long d = 0;
+    int shift = 0;
+
+    while (**p & 0x80) {
+	d |= (unsigned long)(*(*p)++ & 0x7f) << shift;
+	shift += 7;
+    }
+    d |= (unsigned long)*(*p)++ << shift;
+    *prev += d;
+    return *prev - 1;
+}
+
+/* bring the index of field k up to date with the mapped overview.
+ * \return 0 if it cannot be used */
+static int
+xpi_update(unsigned int k)
+{
+    if (xpi[k].list && xpi[k].gen != xovergen)
+	xpi_free(k);
+    if (!xpi[k].list) {
+	xpi[k].list = (struct xpilist *)critmalloc(XPI_BUCKETS
+		* sizeof(struct xpilist), "xpi_update");
+	memset(xpi[k].list, 0, XPI_BUCKETS * sizeof(struct xpilist));
+	xpi[k].gen = xovergen;
+	xpi[k].n = 0;
+    }
+    for (; xpi[k].n < xcount; xpi[k].n++) {
+	const char *t;
+	size_t len, j;
+
+	switch (xoverheader(xpi[k].n, xpifield[k], &t, &len)) {
+	case 1:
+	    for (j = 0; j + 3 <= len; j++)
+		xpi_add(&xpi[k].list[xpi_hash(t + j)], xpi[k].n);
+	    break;
+	case -1:
+	    /* cannot happen for the standard fields */
+	    xpi_free(k);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+static int
+_compsize(const void *a, const void *b)
+{
+    const struct xpilist *la = *(const struct xpilist *const *)a;
+    const struct xpilist *lb = *(const struct xpilist *const *)b;
+
+    return (la->len > lb->len) - (la->len < lb->len);
+}
+
+static int
+_compulong(const void *a, const void *b)
+{
+    unsigned long la = *(const unsigned long *)a;
+    unsigned long lb = *(const unsigned long *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+/* append the entries in [first, last] that contain all trigrams of the
+ * literal runs of w to cand, starting at *n.
+ * \return 0 if w has no trigrams to look for */
+static int
+xpi_match1(unsigned int k, const struct wildpat *w, unsigned long first,
+	unsigned long last, unsigned long *n)
+{
+    const char *run[XPI_MAXRUNS];
+    size_t len[XPI_MAXRUNS], nrun, r, j;
+    const struct xpilist *l[XPI_MAXLISTS * 2];
+    unsigned int nl = 0, m, q;
+    unsigned long c, nc, prev, e;
+    const unsigned char *p, *end;
+
+    nrun = wildpat_literals(w, 3, run, len, XPI_MAXRUNS);
+    for (r = 0; r < nrun; r++) {
+	for (j = 0; j + 3 <= len[r] && nl < XPI_MAXLISTS * 2; j++) {
+	    const struct xpilist *b = &xpi[k].list[xpi_hash(run[r] + j)];
+
+	    for (q = 0; q < nl && l[q] != b; q++)
+		;
+	    if (q == nl)
+		l[nl++] = b;
+	}
+    }
+    if (!nl)
+	return 0;
+    /* the shortest lists narrow the candidates fastest */
+    qsort(l, nl, sizeof(l[0]), _compsize);
+    if (nl > XPI_MAXLISTS)
+	nl = XPI_MAXLISTS;
+
+    nc = 0;
+    p = l[0]->buf;
+    end = p + l[0]->len;
+    for (prev = 0; p < end;) {
+	e = xpi_next(&p, &prev);
+	if (e > last)
+	    break;
+	if (e >= first)
+	    tmp[nc++] = e;
+    }
+    for (m = 1; m < nl && nc; m++) {
+	unsigned long kept = 0;
+
+	p = l[m]->buf;
+	end = p + l[m]->len;
+	prev = 0;
+	e = 0;
+	for (c = 0; c < nc; c++) {
+	    while (p < end && (prev == 0 || e < tmp[c]))
+		e = xpi_next(&p, &prev);
+	    if (prev == 0 || e < tmp[c])
+		break;
+	    if (e == tmp[c])
+		tmp[kept++] = e;
+	}
+	nc = kept;
+    }
+    memcpy(cand + *n, tmp, nc * sizeof(unsigned long));
+    *n += nc;
+    return 1;
+}
+
+/**
+ * Find the overview entries of the current group between \p first and
+ * \p last whose field \p f may match \p w or one of its alternatives.
+ * \return 1 and the entries in ascending order in \p cand and \p n,
+ * valid until the next call, or 0 if the index cannot narrow the
+ * search and all entries must be checked.
+ */
+int
+xpatindex_find(enum xoverfields f, const struct wildpat *w,
+	unsigned long first, unsigned long last,
+	/*@out@*/ const unsigned long **cand_out, /*@out@*/ unsigned long *n)
+{
+    unsigned int k, alts = 0;
+    const struct wildpat *a;
+
+    /* indexes of other groups are of no use anymore */
+    for (k = 0; k < XPI_FIELDS; k++)
+	if (xpi[k].gen != xovergen)
+	    xpi_free(k);
+    for (k = 0; k < XPI_FIELDS && xpifield[k] != f; k++)
+	;
+    if (k == XPI_FIELDS || !w || xpat_index == 0 || xcount < xpat_index
+	    || first > last || last >= xcount)
+	return 0;
+    for (a = w; a; a = wildpat_next(a))
+	alts++;
+    if (alts * xcount > candsize) {
+	candsize = alts * xcount;
+	cand = (unsigned long *)critrealloc((char *)cand,
+		candsize * sizeof(unsigned long), "xpatindex_find");
+    }
+    if (xcount > tmpsize) {
+	tmpsize = xcount;
+	tmp = (unsigned long *)critrealloc((char *)tmp,
+		tmpsize * sizeof(unsigned long), "xpatindex_find");
+    }
+    if (!xpi_update(k))
+	return 0;
+    *n = 0;
+    for (a = w; a; a = wildpat_next(a))
+	if (!xpi_match1(k, a, first, last, n))
+	    return 0;
+    if (alts > 1 && *n > 1) {
+	unsigned long i, j;
+
+	qsort(cand, *n, sizeof(unsigned long), _compulong);
+	for (i = j = 1; i < *n; i++)
+	    if (cand[i] != cand[j - 1])
+		cand[j++] = cand[i];
+	*n = j;
+    }
+    *cand_out = cand;
+    return 1;
+}
@@ -0,0 +1,8 @@
+#ifndef XPATINDEX_H
+#define XPATINDEX_H
+
+int xpatindex_find(enum xoverfields f, const struct wildpat *w,
+	unsigned long first, unsigned long last,
+	/*@out@*/ const unsigned long **cand, /*@out@*/ unsigned long *n);
+
+#endif